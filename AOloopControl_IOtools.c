@@ -138,6 +138,35 @@ extern AOloopControl_var aoloopcontrol_var; // declared in AOloopControl.c
 //
 
 
+/**
+ * @brief Convert datatype string argument to datatype code
+ *
+ * Accepts "UINT8", "INT8", "UINT16", "INT16", "UINT32", "INT32", "UINT64", "INT64", "HALF", "FLOAT", "DOUBLE".\n
+ * Returns 0 (automatic) for "auto" or unrecognized string.
+ */
+uint8_t AOloopControl_IOtools_datatype_code(const char *typestr)
+{
+    if(strcmp(typestr, "UINT8") == 0)  return _DATATYPE_UINT8;
+    if(strcmp(typestr, "INT8") == 0)   return _DATATYPE_INT8;
+    if(strcmp(typestr, "UINT16") == 0) return _DATATYPE_UINT16;
+    if(strcmp(typestr, "INT16") == 0)  return _DATATYPE_INT16;
+    if(strcmp(typestr, "UINT32") == 0) return _DATATYPE_UINT32;
+    if(strcmp(typestr, "INT32") == 0)  return _DATATYPE_INT32;
+    if(strcmp(typestr, "UINT64") == 0) return _DATATYPE_UINT64;
+    if(strcmp(typestr, "INT64") == 0)  return _DATATYPE_INT64;
+#ifdef _DATATYPE_HALF
+    if(strcmp(typestr, "HALF") == 0)   return _DATATYPE_HALF;
+#endif
+    if(strcmp(typestr, "FLOAT") == 0)  return _DATATYPE_FLOAT;
+    if(strcmp(typestr, "DOUBLE") == 0) return _DATATYPE_DOUBLE;
+
+    if(strcmp(typestr, "auto") != 0)
+        printf("WARNING: datatype \"%s\" not recognized, using automatic datatype\n", typestr);
+
+    return 0;
+}
+
+
 
 /* =============================================================================================== */
 /* =============================================================================================== */
@@ -157,6 +186,16 @@ int_fast8_t AOloopControl_IOtools_camimage_extract2D_sharedmem_loop_cli() {
 }
 
 
+/** @brief CLI function for AOloopControl_camimage_extract2D_bin_sharedmem_loop */
+int_fast8_t AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,5)+CLI_checkarg(3,3)+CLI_checkarg(4,2)+CLI_checkarg(5,2)+CLI_checkarg(6,2)+CLI_checkarg(7,2)+CLI_checkarg(8,2)+CLI_checkarg(9,2)+CLI_checkarg(10,5)==0) {
+        AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.string , data.cmdargtoken[4].val.numl, data.cmdargtoken[5].val.numl, data.cmdargtoken[6].val.numl, data.cmdargtoken[7].val.numl, data.cmdargtoken[8].val.numl, data.cmdargtoken[9].val.numl, AOloopControl_IOtools_datatype_code(data.cmdargtoken[10].val.string));
+        return 0;
+    }
+    else return 1;
+}
+
+
 
 
 /* =============================================================================================== */
@@ -166,7 +205,62 @@ int_fast8_t AOloopControl_IOtools_camimage_extract2D_sharedmem_loop_cli() {
 /* =============================================================================================== */
 /* =============================================================================================== */
 
-// No command line hooks to functions in this section
+/** @brief CLI function for AOloopControl_shmim_resize */
+int_fast8_t AOloopControl_IOtools_shmim_resize_cli() {
+    if(CLI_checkarg(1,5)+CLI_checkarg(2,2)+CLI_checkarg(3,2)+CLI_checkarg(4,2)+CLI_checkarg(5,5)==0) {
+        uint32_t sizearray[3];
+        long naxis = 3;
+
+        sizearray[0] = data.cmdargtoken[2].val.numl;
+        sizearray[1] = data.cmdargtoken[3].val.numl;
+        sizearray[2] = data.cmdargtoken[4].val.numl;
+        if(sizearray[2] == 0)
+            naxis = 2;
+        AOloopControl_IOtools_shmim_resize(data.cmdargtoken[1].val.string, naxis, sizearray, AOloopControl_IOtools_datatype_code(data.cmdargtoken[5].val.string));
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_loadcreate_shmim_batch */
+int_fast8_t AOloopControl_IOtools_loadcreate_shmim_batch_cli() {
+    if(CLI_checkarg(1,5)+CLI_checkarg(2,2)==0) {
+        AOloopControl_IOtools_loadcreate_shmim_batch(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.numl);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_loadcreate_setverbose */
+int_fast8_t AOloopControl_IOtools_loadcreate_setverbose_cli() {
+    if(CLI_checkarg(1,2)==0) {
+        AOloopControl_IOtools_loadcreate_setverbose(data.cmdargtoken[1].val.numl);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_shmim_snapshot_save */
+int_fast8_t AOloopControl_IOtools_shmim_snapshot_save_cli() {
+    if(CLI_checkarg(1,5)+CLI_checkarg(2,5)==0) {
+        AOloopControl_IOtools_shmim_snapshot_save(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_shmim_snapshot_load */
+int_fast8_t AOloopControl_IOtools_shmim_snapshot_load_cli() {
+    if(CLI_checkarg(1,5)+CLI_checkarg(2,5)==0) {
+        AOloopControl_IOtools_shmim_snapshot_load(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string);
+        return 0;
+    }
+    else return 1;
+}
 
 
 /* =============================================================================================== */
@@ -187,6 +281,90 @@ int_fast8_t AOloopControl_IOtools_AveStream_cli() {
 }
 
 
+/** @brief CLI function for AOloopControl_AveStreamBank
+ *
+ * Averaging coefficients are given as comma-separated list, for example 0.1,0.01,0.001
+ */
+int_fast8_t AOloopControl_IOtools_AveStreamBank_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,5)+CLI_checkarg(3,3)+CLI_checkarg(4,5)+CLI_checkarg(5,2)==0) {
+        double alpha[AVESTREAM_MAXNBALPHA];
+        int NBalpha = 0;
+        char alphastr[200];
+        char *token;
+
+        strncpy(alphastr, data.cmdargtoken[2].val.string, 199);
+        alphastr[199] = '\0';
+        token = strtok(alphastr, ",");
+        while((token != NULL)&&(NBalpha < AVESTREAM_MAXNBALPHA)) {
+            alpha[NBalpha] = strtod(token, NULL);
+            NBalpha++;
+            token = strtok(NULL, ",");
+        }
+        AOloopControl_IOtools_AveStreamBank(data.cmdargtoken[1].val.string, NBalpha, alpha, data.cmdargtoken[3].val.string, data.cmdargtoken[4].val.string, data.cmdargtoken[5].val.numl);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_WindowStatStream
+ *
+ * Percentiles are given as comma-separated list of fractions, for example 0.1,0.5,0.9, or null
+ */
+int_fast8_t AOloopControl_IOtools_WindowStatStream_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,2)+CLI_checkarg(3,3)+CLI_checkarg(4,3)+CLI_checkarg(5,5)+CLI_checkarg(6,5)==0) {
+        double pct[WINDOWSTAT_MAXNBPCT];
+        int NBpct = 0;
+        char pctstr[200];
+        char *token;
+
+        if(strcmp(data.cmdargtoken[5].val.string, "null") != 0) {
+            strncpy(pctstr, data.cmdargtoken[5].val.string, 199);
+            pctstr[199] = '\0';
+            token = strtok(pctstr, ",");
+            while((token != NULL)&&(NBpct < WINDOWSTAT_MAXNBPCT)) {
+                pct[NBpct] = strtod(token, NULL);
+                NBpct++;
+                token = strtok(NULL, ",");
+            }
+        }
+        AOloopControl_IOtools_WindowStatStream(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.numl, data.cmdargtoken[3].val.string, data.cmdargtoken[4].val.string, NBpct, pct, data.cmdargtoken[6].val.string);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_TemporalPSDStream */
+int_fast8_t AOloopControl_IOtools_TemporalPSDStream_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,2)+CLI_checkarg(3,2)+CLI_checkarg(4,2)+CLI_checkarg(5,3)==0) {
+        AOloopControl_IOtools_TemporalPSDStream(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.numl, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.numl, data.cmdargtoken[5].val.string);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_DisplayStream */
+int_fast8_t AOloopControl_IOtools_DisplayStream_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,3)+CLI_checkarg(3,2)+CLI_checkarg(4,2)+CLI_checkarg(5,1)+CLI_checkarg(6,2)+CLI_checkarg(7,2)==0) {
+        AOloopControl_IOtools_DisplayStream(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.numl, data.cmdargtoken[5].val.numf, data.cmdargtoken[6].val.numl, data.cmdargtoken[7].val.numl);
+        return 0;
+    }
+    else return 1;
+}
+
+
+/** @brief CLI function for AOloopControl_IIRfilterStream */
+int_fast8_t AOloopControl_IOtools_IIRfilterStream_cli() {
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,4)+CLI_checkarg(3,3)+CLI_checkarg(4,2)==0) {
+        AOloopControl_IOtools_IIRfilterStream(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.string, data.cmdargtoken[4].val.numl);
+        return 0;
+    }
+    else return 1;
+}
+
+
 /** @brief Aligns data stream */
 int_fast8_t AOloopControl_IOtools_imAlignStream_cli() {
 	if(CLI_checkarg(1,4)+CLI_checkarg(2,2)+CLI_checkarg(3,2)+CLI_checkarg(4,4)+CLI_checkarg(5,3)+CLI_checkarg(6,2)==0) {
@@ -197,6 +375,45 @@ int_fast8_t AOloopControl_IOtools_imAlignStream_cli() {
 }
 
 
+/** @brief Aligns data stream, with options */
+int_fast8_t AOloopControl_IOtools_imAlignStream_opt_cli() {
+	if(CLI_checkarg(1,4)+CLI_checkarg(2,2)+CLI_checkarg(3,2)+CLI_checkarg(4,4)+CLI_checkarg(5,3)+CLI_checkarg(6,2)+CLI_checkarg(7,2)+CLI_checkarg(8,5)+CLI_checkarg(9,2)+CLI_checkarg(10,2)+CLI_checkarg(11,1)+CLI_checkarg(12,5)+CLI_checkarg(13,2)+CLI_checkarg(14,2)==0) {
+		IMALIGN_OPTIONS opt;
+
+		AOloopControl_IOtools_imAlignStream_defaultoptions(&opt);
+		opt.peakmode = data.cmdargtoken[7].val.numl;
+		if(strcmp(data.cmdargtoken[8].val.string, "null") != 0)
+			strncpy(opt.SAname, data.cmdargtoken[8].val.string, 199);
+		opt.SANBframe = data.cmdargtoken[9].val.numl;
+		opt.selmode = data.cmdargtoken[10].val.numl;
+		opt.selfrac = data.cmdargtoken[11].val.numf;
+		if(strcmp(data.cmdargtoken[12].val.string, "null") != 0)
+			strncpy(opt.qualname, data.cmdargtoken[12].val.string, 199);
+		opt.pyrlevel = data.cmdargtoken[13].val.numl;
+		opt.pyrwin = data.cmdargtoken[14].val.numl;
+		AOloopControl_IOtools_imAlignStream_opt(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.numl, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.string, data.cmdargtoken[5].val.string, data.cmdargtoken[6].val.numl, &opt);
+		return 0;
+	}
+	else return 1;
+}
+
+
+/** @brief Measure alignment offsets of data stream, no translation */
+int_fast8_t AOloopControl_IOtools_imAlignStream_offsets_cli() {
+	if(CLI_checkarg(1,4)+CLI_checkarg(2,2)+CLI_checkarg(3,2)+CLI_checkarg(4,4)+CLI_checkarg(5,3)+CLI_checkarg(6,2)+CLI_checkarg(7,2)+CLI_checkarg(8,2)==0) {
+		IMALIGN_OPTIONS opt;
+
+		AOloopControl_IOtools_imAlignStream_defaultoptions(&opt);
+		opt.outmode = IMALIGN_OUT_OFFSETS;
+		opt.peakmode = data.cmdargtoken[7].val.numl;
+		opt.pyrlevel = data.cmdargtoken[8].val.numl;
+		AOloopControl_IOtools_imAlignStream_opt(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.numl, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.string, data.cmdargtoken[5].val.string, data.cmdargtoken[6].val.numl, &opt);
+		return 0;
+	}
+	else return 1;
+}
+
+
 /** @brief CLI function for AOloopControl_frameDelay */
 int_fast8_t AOloopControl_IOtools_frameDelay_cli()
 {
@@ -208,11 +425,22 @@ int_fast8_t AOloopControl_IOtools_frameDelay_cli()
 }
 
 
+/** @brief CLI function for AOloopControl_frameDelayRing */
+int_fast8_t AOloopControl_IOtools_frameDelayRing_cli()
+{
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,3)+CLI_checkarg(3,2)+CLI_checkarg(4,2)==0)    {
+        AOloopControl_IOtools_frameDelayRing(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.numl);
+        return 0;
+    }
+    else        return 1;
+}
+
+
 
 /** @brief CLI function for AOloopControl_stream3Dto2D */
 int_fast8_t AOloopControl_IOtools_stream3Dto2D_cli() {
-    if(CLI_checkarg(1,4)+CLI_checkarg(2,3)+CLI_checkarg(3,2)+CLI_checkarg(4,2)==0) {
-        AOloopControl_IOtools_stream3Dto2D(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.numl);
+    if(CLI_checkarg(1,4)+CLI_checkarg(2,3)+CLI_checkarg(3,2)+CLI_checkarg(4,2)+CLI_checkarg(5,1)+CLI_checkarg(6,1)+CLI_checkarg(7,2)==0) {
+        AOloopControl_IOtools_stream3Dto2D(data.cmdargtoken[1].val.string, data.cmdargtoken[2].val.string, data.cmdargtoken[3].val.numl, data.cmdargtoken[4].val.numl, data.cmdargtoken[5].val.numf, data.cmdargtoken[6].val.numf, data.cmdargtoken[7].val.numl);
         return 0;
     }
     else return 1;
@@ -278,6 +506,26 @@ int_fast8_t init_AOloopControl_IOtools()
 
     RegisterCLIcommand("cropshim", __FILE__, AOloopControl_IOtools_camimage_extract2D_sharedmem_loop_cli, "crop shared mem image", "<input image> <optional dark> <output image> <sizex> <sizey> <xstart> <ystart>" , "cropshim imin null imout 32 32 153 201", "int AOloopControl_IOtools_camimage_extract2D_sharedmem_loop(char *in_name, const char *dark_name, char *out_name, long size_x, long size_y, long xstart, long ystart)");
 
+    RegisterCLIcommand("cropshimbin", __FILE__, AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop_cli, "crop, bin and convert shared mem image", "<input image> <optional dark> <output image> <sizex> <sizey> <xstart> <ystart> <bin factor> <bin mode: 0=sum 1=average> <output type: auto UINT16 INT16 FLOAT>" , "cropshimbin imin null imout 64 64 153 201 2 1 FLOAT", "int AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop(const char *in_name, const char *dark_name, const char *out_name, long size_x, long size_y, long xstart, long ystart, int binfact, int binmode, uint8_t datatypeout)");
+
+
+
+/* =============================================================================================== */
+/* =============================================================================================== */
+/** @name AOloopControl_IOtools - 2. LOAD DATA STREAMS
+ *  Load 2D and 3D shared memory images */
+/* =============================================================================================== */
+/* =============================================================================================== */
+
+    RegisterCLIcommand("aolshmresize", __FILE__, AOloopControl_IOtools_shmim_resize_cli, "resize shared mem image in-process, increments generation counter cnt2", "<stream> <xsize> <ysize> <zsize, 0 for 2D> <datatype: auto UINT8 ... DOUBLE>" , "aolshmresize aol0_wfsmask 120 120 0 auto", "long AOloopControl_IOtools_shmim_resize(const char *name, long naxis, const uint32_t *size, uint8_t datatype)");
+
+    RegisterCLIcommand("aolloadshmbatch", __FILE__, AOloopControl_IOtools_loadcreate_shmim_batch_cli, "load/create shared mem images listed in manifest, concurrently", "<manifest file: 2D name file xsize ysize default [datatype] | 3D name file xsize ysize zsize default [datatype]> <nb threads>" , "aolloadshmbatch conf/shmload.txt 8", "long AOloopControl_IOtools_loadcreate_shmim_batch(const char *manifest_fname, int NBthread)");
+
+    RegisterCLIcommand("aolloadshmverbose", __FILE__, AOloopControl_IOtools_loadcreate_setverbose_cli, "set verbosity of shared mem image loaders", "<level: 0 silent, 1 load report, 2 step tracing>" , "aolloadshmverbose 2", "int AOloopControl_IOtools_loadcreate_setverbose(int level)");
+
+    RegisterCLIcommand("aolsnapsave", __FILE__, AOloopControl_IOtools_shmim_snapshot_save_cli, "save stream to snapshot file (native binary format, checksummed)", "<stream> <snapshot file>" , "aolsnapsave aol0_wfsref0 conf/aol0_wfsref0.snap", "long AOloopControl_IOtools_shmim_snapshot_save(const char *IDname, const char *fname)");
+
+    RegisterCLIcommand("aolsnapload", __FILE__, AOloopControl_IOtools_shmim_snapshot_load_cli, "load snapshot file into stream, parallel reads with checksum verification", "<snapshot file> <stream>" , "aolsnapload conf/aol0_wfsref0.snap aol0_wfsref0", "long AOloopControl_IOtools_shmim_snapshot_load(const char *fname, const char *IDname)");
 
 
 
@@ -291,11 +539,27 @@ int_fast8_t init_AOloopControl_IOtools()
 
     RegisterCLIcommand("aveACshmim", __FILE__, AOloopControl_IOtools_AveStream_cli, "average and AC shared mem image", "<input image> <coeff> <output image ave> <output AC> <output RMS>" , "aveACshmim imin 0.01 outave outAC outRMS", "int AOloopControl_IOtools_AveStream(char *IDname, double alpha, char *IDname_out_ave, char *IDname_out_AC, char *IDname_out_RMS)");
 
+    RegisterCLIcommand("aveshmimbank", __FILE__, AOloopControl_IOtools_AveStreamBank_cli, "multi-timescale average of shared mem image", "<input image> <coeff list> <output image ave> <output RMS or null> <output mode: 0=3D 1=separate streams>" , "aveshmimbank imin 0.1,0.01,0.001 outave outRMS 0", "int AOloopControl_IOtools_AveStreamBank(const char *IDname, int NBalpha, const double *alpha, const char *IDname_out_ave, const char *IDname_out_RMS, int outmode)");
+
+    RegisterCLIcommand("winstatshmim", __FILE__, AOloopControl_IOtools_WindowStatStream_cli, "sliding window statistics of shared mem image", "<input image> <window size> <output ave> <output RMS> <percentile list or null> <output percentiles>" , "winstatshmim imin 1000 outave outRMS 0.1,0.5,0.9 outpct", "int AOloopControl_IOtools_WindowStatStream(const char *IDname, long NBwin, const char *IDname_out_ave, const char *IDname_out_RMS, int NBpct, const double *pct, const char *IDname_out_pct)");
+
+    RegisterCLIcommand("psdshmim", __FILE__, AOloopControl_IOtools_TemporalPSDStream_cli, "temporal PSD of shared mem image elements", "<input image> <nb frames> <segment length> <update period> <output PSD>" , "psdshmim modeval 4096 512 1000 modevalPSD", "long AOloopControl_IOtools_TemporalPSDStream(const char *IDname, long NBframe, long seglen, long NBupdate, const char *IDname_out)");
+
+    RegisterCLIcommand("dispshmim", __FILE__, AOloopControl_IOtools_DisplayStream_cli, "low-rate binned display copy of shared mem image", "<input image> <output image> <bin factor> <mode: 0=decimate 1=average> <rate [Hz]> <sem index (average mode)> <CPU, -1=any>" , "dispshmim imWFS0 imWFS0disp 2 1 10.0 5 0", "long AOloopControl_IOtools_DisplayStream(const char *IDname, const char *IDname_out, int binfact, int avemode, float rate, int insem, int cpu)");
+
+    RegisterCLIcommand("iirfiltshmim", __FILE__, AOloopControl_IOtools_IIRfilterStream_cli, "per-element IIR filter bank on shared mem image", "<input image> <coefficients: x=element, y=b0..bN,a0..aN> <output image> <sem index>" , "iirfiltshmim modeval modevalIIRcoeff modevalfilt 3", "int_fast8_t AOloopControl_IOtools_IIRfilterStream(const char *IDname, const char *IDcoeff_name, const char *IDname_out, int insem)");
+
 	RegisterCLIcommand("alignshmim", __FILE__, AOloopControl_IOtools_imAlignStream_cli, "align image stream to reference", "<input stream> <box x offset> <box y offset> <ref stream> <output stream> <sem index>" , "alignshmim imin 100 100 imref imout 3", "int_fast8_t AOloopControl_IOtools_imAlignStream(const char *IDname, int xbox0, int ybox0, const char *IDref_name, const char *IDout_name, int insem)");
 
+	RegisterCLIcommand("alignshmimx", __FILE__, AOloopControl_IOtools_imAlignStream_opt_cli, "align image stream to reference, with options", "<input stream> <box x offset> <box y offset> <ref stream> <output stream> <sem index> <peak mode: 0=Gauss centroid 1=parabolic 2=quad3x3 3=quad5x5 4=centroid5x5> <shift-and-add stream or null> <SA nb frames, 0=infinite> <selection: 0=none 1=corr peak 2=Strehl> <fraction kept> <quality stream or null> <pyramid level, 0=off> <pyramid fine window size, 0=auto>" , "alignshmimx imin 100 100 imref imout 3 2 imSA 0 2 0.1 imqual 0 0", "int_fast8_t AOloopControl_IOtools_imAlignStream_opt(const char *IDname, int xbox0, int ybox0, const char *IDref_name, const char *IDout_name, int insem, const IMALIGN_OPTIONS *opt)");
+
+	RegisterCLIcommand("alignshmimtt", __FILE__, AOloopControl_IOtools_imAlignStream_offsets_cli, "measure image stream offset to reference (tip/tilt)", "<input stream> <box x offset> <box y offset> <ref stream> <output offsets stream> <sem index> <peak mode> <pyramid level, 0=off>" , "alignshmimtt imin 100 100 imref imTT 3 2 2", "int_fast8_t AOloopControl_IOtools_imAlignStream_opt(const char *IDname, int xbox0, int ybox0, const char *IDref_name, const char *IDout_name, int insem, const IMALIGN_OPTIONS *opt)");
+
     RegisterCLIcommand("aolframedelay", __FILE__, AOloopControl_IOtools_frameDelay_cli, "introduce temporal delay", "<in> <temporal kernel> <out> <sem index>","aolframedelay in kern out 0","long AOloopControl_IOtools_frameDelay(const char *IDin_name, const char *IDkern_name, const char *IDout_name, int insem)");
 
-    RegisterCLIcommand("aolstream3Dto2D", __FILE__, AOloopControl_IOtools_stream3Dto2D_cli, "remaps 3D cube into 2D image", "<input 3D stream> <output 2D stream> <# cols> <sem trigger>" , "aolstream3Dto2D in3dim out2dim 4 1", "long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_name, int NBcols, int insem)");
+    RegisterCLIcommand("aolframedelayring", __FILE__, AOloopControl_IOtools_frameDelayRing_cli, "pure temporal delay, 3D ring output, cnt1 = delayed slice", "<in> <out ring> <delay [frame]> <sem index>","aolframedelayring in outring 2 0","long AOloopControl_IOtools_frameDelayRing(const char *IDin_name, const char *IDout_name, long delay, int insem)");
+
+    RegisterCLIcommand("aolstream3Dto2D", __FILE__, AOloopControl_IOtools_stream3Dto2D_cli, "remaps 3D cube into 2D image", "<input 3D stream> <output 2D stream> <# cols> <sem trigger> <flux [ph per unit input], 0=no noise> <contrast coeff> <noise seed>" , "aolstream3Dto2D in3dim out2dim 4 1 7.52e11 0.0379 1", "long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_name, int NBcols, int insem, float Flux, float ContrastCoeff, long seed)");
 
 
 /* =============================================================================================== */
@@ -16,6 +16,48 @@
 #include <AOloopControl/AOloopControl.h>
 
 
+// maximum number of averaging timescales in AOloopControl_IOtools_AveStreamBank()
+#define AVESTREAM_MAXNBALPHA 16
+
+// maximum number of percentiles in AOloopControl_IOtools_WindowStatStream()
+#define WINDOWSTAT_MAXNBPCT 16
+
+
+// imAlignStream correlation peak subpixel estimators
+#define IMALIGN_PEAK_GAUSSCENTROID 0 // iterative Gaussian-weighted centroid over full box
+#define IMALIGN_PEAK_PARABOLIC     1 // separable 3-point parabolic fit
+#define IMALIGN_PEAK_QUADFIT3      2 // 2D quadratic fit on 3x3 neighborhood
+#define IMALIGN_PEAK_QUADFIT5      3 // 2D quadratic fit on 5x5 neighborhood
+#define IMALIGN_PEAK_CENTROID      4 // centroid of 5x5 neighborhood
+
+// imAlignStream shift-and-add frame selection
+#define IMALIGN_SEL_NONE           0 // keep all frames
+#define IMALIGN_SEL_CORRPEAK       1 // select on correlation peak value
+#define IMALIGN_SEL_STREHL         2 // select on max/sum of aligned frame (Strehl proxy)
+
+// imAlignStream output mode
+#define IMALIGN_OUT_IMAGE          0 // output stream is aligned frame
+#define IMALIGN_OUT_OFFSETS        1 // output stream is (x, y, peak, frame counter), no translation
+
+#define IMALIGN_MAXPYRLEVEL        6 // max pyramid registration level (binning 64)
+
+/** @brief imAlignStream options */
+typedef struct
+{
+    int   peakmode;        // correlation peak subpixel estimator, IMALIGN_PEAK_*
+    int   outmode;         // output mode, IMALIGN_OUT_*
+
+    char  SAname[200];     // shift-and-add (long exposure) output stream, empty for none
+    long  SANBframe;       // number of kept frames per long exposure, 0 for no restart
+    int   selmode;         // frame selection, IMALIGN_SEL_*
+    float selfrac;         // fraction of frames kept
+    char  qualname[200];   // per-frame offset/quality output stream, empty for none
+
+    int   pyrlevel;        // pyramid registration: coarse level binning 2^pyrlevel, 0 for single level
+    long  pyrwin;          // pyramid registration: fine window size, 0 for automatic
+} IMALIGN_OPTIONS;
+
+
 
 
 
@@ -31,6 +73,9 @@ void __attribute__ ((constructor)) libinit_AOloopControl_IOtools();
 /** @brief Initialize command line interface. */
 int_fast8_t init_AOloopControl_IOtools();
 
+/** @brief Convert datatype string ("UINT8" ... "DOUBLE", "auto") to datatype code, 0 if automatic */
+uint8_t AOloopControl_IOtools_datatype_code(const char *typestr);
+
 
 
 
@@ -44,6 +89,9 @@ int_fast8_t init_AOloopControl_IOtools();
 
 int_fast8_t AOloopControl_IOtools_camimage_extract2D_sharedmem_loop(const char *in_name, const char *dark_name, const char *out_name, long size_x, long size_y, long xstart, long ystart);
 
+/** @brief Crop, bin and convert image stream in a single pass */
+int_fast8_t AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop(const char *in_name, const char *dark_name, const char *out_name, long size_x, long size_y, long xstart, long ystart, int binfact, int binmode, uint8_t datatypeout);
+
 /** @brief compute sum of image pixels */
 static void *compute_function_imtotal( void *ptr );
 
@@ -67,12 +115,36 @@ int_fast8_t Read_cam_frame(long loop, int RM, int normalize, int PixelStreamMode
 /* =============================================================================================== */
 
 
+/** @brief Resize (recreate) shared memory stream in-process, bumping its generation counter (cnt2) */
+long AOloopControl_IOtools_shmim_resize(const char *name, long naxis, const uint32_t *size, uint8_t datatype);
+
 /** @brief Load 2D image in shared memory */
 long AOloopControl_IOtools_2Dloadcreate_shmim(const char *name, const char *fname, long xsize, long ysize, float DefaultValue);
 
 /** @brief Load 3D image in shared memory */
 long AOloopControl_IOtools_3Dloadcreate_shmim(const char *name, const char *fname, long xsize, long ysize, long zsize, float DefaultValue);
 
+/** @brief Load 2D image in shared memory, stream of given datatype (FITS data converted on load) */
+long AOloopControl_IOtools_2Dloadcreate_shmim_datatype(const char *name, const char *fname, long xsize, long ysize, float DefaultValue, uint8_t datatype);
+
+/** @brief Load 3D image in shared memory, stream of given datatype (FITS data converted on load) */
+long AOloopControl_IOtools_3Dloadcreate_shmim_datatype(const char *name, const char *fname, long xsize, long ysize, long zsize, float DefaultValue, uint8_t datatype);
+
+/** @brief Wait until first NBslice slices of 3D stream are loaded, returns number of slices available */
+long AOloopControl_IOtools_3Dshmim_waitslices(const char *name, long NBslice, double timeout);
+
+/** @brief Set verbosity of stream loaders (0: silent, 1: load report, 2: step tracing), returns previous level */
+int AOloopControl_IOtools_loadcreate_setverbose(int level);
+
+/** @brief Load 2D and 3D images listed in manifest file in shared memory, concurrently */
+long AOloopControl_IOtools_loadcreate_shmim_batch(const char *manifest_fname, int NBthread);
+
+/** @brief Save stream to snapshot file (native binary format, checksummed) */
+long AOloopControl_IOtools_shmim_snapshot_save(const char *IDname, const char *fname);
+
+/** @brief Load snapshot file into stream, parallel O_DIRECT reads with checksum verification */
+long AOloopControl_IOtools_shmim_snapshot_load(const char *fname, const char *IDname);
+
 
 
 
@@ -90,6 +162,21 @@ long AOloopControl_IOtools_3Dloadcreate_shmim(const char *name, const char *fnam
 /** @brief Average data stream */
 int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, const char *IDname_out_ave, const char *IDname_out_AC, const char *IDname_out_RMS);
 
+/** @brief Average data stream over multiple timescales */
+int_fast8_t AOloopControl_IOtools_AveStreamBank(const char *IDname, int NBalpha, const double *alpha, const char *IDname_out_ave, const char *IDname_out_RMS, int outmode);
+
+/** @brief Sliding-window average, variance and percentiles of data stream */
+int_fast8_t AOloopControl_IOtools_WindowStatStream(const char *IDname, long NBwin, const char *IDname_out_ave, const char *IDname_out_RMS, int NBpct, const double *pct, const char *IDname_out_pct);
+
+/** @brief Temporal power spectral density of data stream elements */
+long AOloopControl_IOtools_TemporalPSDStream(const char *IDname, long NBframe, long seglen, long NBupdate, const char *IDname_out);
+
+/** @brief Low-rate, binned copy of data stream for display */
+long AOloopControl_IOtools_DisplayStream(const char *IDname, const char *IDname_out, int binfact, int avemode, float rate, int insem, int cpu);
+
+/** @brief Per-element IIR filter bank on data stream, coefficients hot-swappable */
+int_fast8_t AOloopControl_IOtools_IIRfilterStream(const char *IDname, const char *IDcoeff_name, const char *IDname_out, int insem);
+
 /** @brief Aligns data stream */
 int_fast8_t AOloopControl_IOtools_imAlignStream(
     const char    *IDname,
@@ -100,11 +187,20 @@ int_fast8_t AOloopControl_IOtools_imAlignStream(
           int      insem
 );
 
+/** @brief Set default imAlignStream options */
+void AOloopControl_IOtools_imAlignStream_defaultoptions(IMALIGN_OPTIONS *opt);
+
+/** @brief Aligns data stream, with options */
+int_fast8_t AOloopControl_IOtools_imAlignStream_opt(const char *IDname, int xbox0, int ybox0, const char *IDref_name, const char *IDout_name, int insem, const IMALIGN_OPTIONS *opt);
+
 /** @brief Induces temporal offset between input and output streams */
 long AOloopControl_IOtools_frameDelay(const char *IDin_name, const char *IDkern_name, const char *IDout_name, int insem);
 
+/** @brief Pure delay, output is a 3D ring with cnt1 = delayed slice index */
+long AOloopControl_IOtools_frameDelayRing(const char *IDin_name, const char *IDout_name, long delay, int insem);
+
 /** @brief Re-arrange a 3D cube into an array of images into a single 2D frame */
-long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_name, int NBcols, int insem);
+long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_name, int NBcols, int insem, float Flux, float ContrastCoeff, long seed);
 
 
 
@@ -51,6 +51,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 #include <pthread.h>
 
 #include "CommandLineInterface/CLIcore.h"
@@ -172,31 +173,212 @@ int_fast8_t AOloopControl_IOtools_camimage_extract2D_sharedmem_loop(
     long        ystart
 )
 {
-    long iiin,jjin, iiout, jjout;
-    long IDin, IDout, IDdark;
-    uint8_t datatype;
-    uint8_t datatypeout;
-    uint32_t *sizeout;
-    long long cnt0;
-    long IDmask;
-    long sizeoutxy;
+    // no binning, output datatype follows input (float if dark subtracted)
+    return AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop(in_name, dark_name, out_name, size_x, size_y, xstart, ystart, 1, 0, 0);
+}
+
+
+
+
+
+/**
+ * @brief Accumulate segment of input image row into float line buffer
+ *
+ * acc[ii] += in[offset+ii] - dark[offset+ii] for ii = 0 ... n-1\n
+ * dark is optional (NULL if none)\n
+ * Loops are contiguous and branch-free so that they are vectorized by compiler
+ */
+static void camimage_accumulate_row(
+    float       *restrict acc,
+    IMAGE       *img,
+    const float *restrict dark,
+    long         offset,
+    long         n
+)
+{
     long ii;
 
+    switch (img->md[0].datatype) {
+    case _DATATYPE_UINT8 :
+    {
+        const uint8_t *restrict in = img->array.UI8 + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    case _DATATYPE_UINT16 :
+    {
+        const uint16_t *restrict in = img->array.UI16 + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    case _DATATYPE_INT16 :
+    {
+        const int16_t *restrict in = img->array.SI16 + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    case _DATATYPE_UINT32 :
+    {
+        const uint32_t *restrict in = img->array.UI32 + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    case _DATATYPE_INT32 :
+    {
+        const int32_t *restrict in = img->array.SI32 + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    case _DATATYPE_FLOAT :
+    {
+        const float *restrict in = img->array.F + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += in[ii];
+    }
+    break;
+    case _DATATYPE_DOUBLE :
+    {
+        const double *restrict in = img->array.D + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] += (float) in[ii];
+    }
+    break;
+    }
 
-    sizeout = (uint32_t*) malloc(sizeof(uint32_t)*2);
-    sizeout[0] = size_x;
-    sizeout[1] = size_y;
-    sizeoutxy = size_x*size_y;
+    if(dark != NULL)
+    {
+        const float *restrict darkrow = dark + offset;
+        for(ii=0; ii<n; ii++)
+            acc[ii] -= darkrow[ii];
+    }
+}
+
+
+
+
+/**
+ * ## Purpose
+ *
+ * Crop, dark-subtract, bin, mask and convert image stream in a single pass
+ *
+ * ## Arguments
+ *
+ * @param[in]
+ * in_name		CHAR*
+ * 			Input stream name (UINT8, UINT16, INT16, UINT32, INT32, FLOAT or DOUBLE)
+ *
+ * @param[in]
+ * dark_name	CHAR*
+ * 			Optional dark (FLOAT, same size as input), subtracted before binning
+ *
+ * @param[out]
+ * out_name		CHAR*
+ * 			Output stream name, size = size_x/binfact x size_y/binfact
+ *
+ * @param[in]
+ * size_x, size_y, xstart, ystart	LONG
+ * 			Crop window, in input pixels
+ *
+ * @param[in]
+ * binfact		INT
+ * 			Binning factor (1 = no binning), must divide size_x and size_y
+ *
+ * @param[in]
+ * binmode		INT
+ * 			0: sum of binned pixels, 1: average of binned pixels
+ *
+ * @param[in]
+ * datatypeout	UINT8
+ * 			Output datatype: _DATATYPE_UINT16, _DATATYPE_INT16, _DATATYPE_FLOAT\n
+ * 			0 for automatic: float if dark or average, otherwise input datatype if UINT16 or INT16
+ *
+ *
+ * ## Details
+ *
+ * Optional image csmask (output size) multiplies the binned output.\n
+ * Each output row is built by accumulating binfact input rows into a float line buffer,
+ * then summing groups of binfact pixels. Integer outputs are rounded and saturated.\n
+ * Float output is written directly into the output stream.
+ *
+ */
+int_fast8_t AOloopControl_IOtools_camimage_extract2D_bin_sharedmem_loop(
+    const char *in_name,
+    const char *dark_name,
+    const char *out_name,
+    long        size_x,
+    long        size_y,
+    long        xstart,
+    long        ystart,
+    int         binfact,
+    int         binmode,
+    uint8_t     datatypeout
+)
+{
+    long IDin, IDout, IDdark, IDmask;
+    uint8_t datatype;
+    uint32_t *sizeout;
+    long long cnt0;
+    long xsizein, ysizein;
+    long size_xout, size_yout, sizeoutxy;
+    long iiout, jjout, ii;
+    int ib, jb;
+    float *rowacc;   // line buffer, input resolution
+    float *outacc;   // output frame, float
+    float *outaccbuff = NULL;
+    const float *darkptr = NULL;
+    float binscale;
+
+
+    if(binfact < 1)
+    {
+        printf("ERROR: binning factor %d should be >= 1\n", binfact);
+        exit(EXIT_FAILURE);
+    }
+    if((size_x % binfact != 0)||(size_y % binfact != 0))
+    {
+        printf("ERROR: crop size %ld x %ld is not a multiple of binning factor %d\n", size_x, size_y, binfact);
+        exit(EXIT_FAILURE);
+    }
+    size_xout = size_x/binfact;
+    size_yout = size_y/binfact;
+    sizeoutxy = size_xout*size_yout;
 
     IDin = image_ID(in_name);
     datatype = data.image[IDin].md[0].datatype;
+    xsizein = data.image[IDin].md[0].size[0];
+    ysizein = data.image[IDin].md[0].size[1];
 
+    if((xstart < 0)||(ystart < 0)||(xstart+size_x > xsizein)||(ystart+size_y > ysizein))
+    {
+        printf("ERROR: crop window [%ld:%ld, %ld:%ld] outside of input image %ld x %ld\n", xstart, xstart+size_x-1, ystart, ystart+size_y-1, xsizein, ysizein);
+        exit(EXIT_FAILURE);
+    }
+
+    switch (datatype) {
+    case _DATATYPE_UINT8 :
+    case _DATATYPE_UINT16 :
+    case _DATATYPE_INT16 :
+    case _DATATYPE_UINT32 :
+    case _DATATYPE_INT32 :
+    case _DATATYPE_FLOAT :
+    case _DATATYPE_DOUBLE :
+        break;
+    default :
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+        break;
+    }
 
 
     // Check if there is a mask
     IDmask = image_ID("csmask");
     if(IDmask!=-1)
-        if((data.image[IDmask].md[0].size[0]!=size_x)||(data.image[IDmask].md[0].size[1]!=size_y))
+        if((data.image[IDmask].md[0].size[0]!=size_xout)||(data.image[IDmask].md[0].size[1]!=size_yout))
         {
             printf("ERROR: csmask has wrong size\n");
             exit(EXIT_FAILURE);
@@ -207,128 +389,115 @@ int_fast8_t AOloopControl_IOtools_camimage_extract2D_sharedmem_loop(
 
     if(IDdark!=-1)
     {
-        if((data.image[IDdark].md[0].size[0]!=data.image[IDin].md[0].size[0])||(data.image[IDdark].md[0].size[1]!=data.image[IDin].md[0].size[1]))
+        if((data.image[IDdark].md[0].size[0]!=xsizein)||(data.image[IDdark].md[0].size[1]!=ysizein))
         {
-            printf("ERROR: csmask has wrong size\n");
+            printf("ERROR: dark has wrong size\n");
             exit(EXIT_FAILURE);
         }
         if(data.image[IDdark].md[0].datatype != _DATATYPE_FLOAT)
         {
-            printf("ERROR: csmask has wrong type\n");
+            printf("ERROR: dark has wrong type\n");
             exit(EXIT_FAILURE);
         }
-        datatypeout = _DATATYPE_FLOAT;
+        darkptr = data.image[IDdark].array.F;
     }
+
+    if(datatypeout == 0)
+    {
+        if((IDdark!=-1)||(binmode==1))
+            datatypeout = _DATATYPE_FLOAT;
+        else if((datatype==_DATATYPE_UINT16)||(datatype==_DATATYPE_INT16))
+            datatypeout = datatype;
+        else
+            datatypeout = _DATATYPE_FLOAT;
+    }
+    if((datatypeout!=_DATATYPE_UINT16)&&(datatypeout!=_DATATYPE_INT16)&&(datatypeout!=_DATATYPE_FLOAT))
+    {
+        printf("ERROR: output datatype %d not supported\n", (int) datatypeout);
+        exit(EXIT_FAILURE);
+    }
+
+    if(binmode==1)
+        binscale = 1.0/(binfact*binfact);
     else
-        datatypeout = datatype;
+        binscale = 1.0;
 
 
     // Create shared memory output image
+    sizeout = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    sizeout[0] = size_xout;
+    sizeout[1] = size_yout;
     IDout = create_image_ID(out_name, 2, sizeout, datatypeout, 1, 0);
+    free(sizeout);
+
+    rowacc = (float*) malloc(sizeof(float)*size_x);
+    if(datatypeout == _DATATYPE_FLOAT)
+        outacc = data.image[IDout].array.F;
+    else
+    {
+        outaccbuff = (float*) malloc(sizeof(float)*sizeoutxy);
+        outacc = outaccbuff;
+    }
 
     cnt0 = -1;
 
-    switch (datatype) {
-    case _DATATYPE_UINT16 :
-        while(1)
+    while(1)
+    {
+        usleep(10); // OK FOR NOW (NOT USED BY FAST WFS)
+        if(data.image[IDin].md[0].cnt0!=cnt0)
         {
-            usleep(10); // OK FOR NOW (NOT USED BY FAST WFS)
-            if(data.image[IDin].md[0].cnt0!=cnt0)
+            data.image[IDout].md[0].write = 1;
+            cnt0 = data.image[IDin].md[0].cnt0;
+
+            for(jjout=0; jjout<size_yout; jjout++)
             {
-                data.image[IDout].md[0].write = 1;
-                cnt0 = data.image[IDin].md[0].cnt0;
-                if(datatypeout == _DATATYPE_UINT16)
-                {
-                    for(iiout=0; iiout<size_x; iiout++)
-                        for(jjout=0; jjout<size_y; jjout++)
-                        {
-                            iiin = xstart + iiout;
-                            jjin = ystart + jjout;
-                            data.image[IDout].array.UI16[jjout*size_x+iiout] = data.image[IDin].array.UI16[jjin*data.image[IDin].md[0].size[0]+iiin];
-                        }
-                    if(IDmask!=-1)
-                        for(ii=0; ii<sizeoutxy; ii++)
-                            data.image[IDout].array.UI16[ii] *= (int) data.image[IDmask].array.F[ii];
-                }
-                else // FLOAT
-                {
-                    if(IDdark==-1)
-                    {
-                        for(iiout=0; iiout<size_x; iiout++)
-                            for(jjout=0; jjout<size_y; jjout++)
-                            {
-                                iiin = xstart + iiout;
-                                jjin = ystart + jjout;
-                                data.image[IDout].array.F[jjout*size_x+iiout] = data.image[IDin].array.UI16[jjin*data.image[IDin].md[0].size[0]+iiin];
-                            }
-                    }
-                    else
-                    {
-                        for(iiout=0; iiout<size_x; iiout++)
-                            for(jjout=0; jjout<size_y; jjout++)
-                            {
-                                iiin = xstart + iiout;
-                                jjin = ystart + jjout;
-                                data.image[IDout].array.F[jjout*size_x+iiout] = 1.0*data.image[IDin].array.UI16[jjin*data.image[IDin].md[0].size[0]+iiin] - data.image[IDdark].array.F[jjin*data.image[IDdark].md[0].size[0]+iiin];
-                            }
-                    }
+                float *restrict outrow = outacc + jjout*size_xout;
 
-                    if(IDmask!=-1)
-                        for(ii=0; ii<sizeoutxy; ii++)
-                            data.image[IDout].array.F[ii] *= data.image[IDmask].array.F[ii];
-                }
+                memset(rowacc, 0, sizeof(float)*size_x);
+                for(jb=0; jb<binfact; jb++)
+                    camimage_accumulate_row(rowacc, &data.image[IDin], darkptr, (ystart + jjout*binfact + jb)*xsizein + xstart, size_x);
 
-                data.image[IDout].md[0].cnt0 = cnt0;
-                data.image[IDout].md[0].write = 0;
-                COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
-            }
-        }
-        break;
-    case _DATATYPE_FLOAT :
-        while(1)
-        {
-            usleep(10); // OK FOR NOW (NOT USED BY FAST WFS)
-            if(data.image[IDin].md[0].cnt0!=cnt0)
-            {
-                data.image[IDout].md[0].write = 1;
-                cnt0 = data.image[IDin].md[0].cnt0;
-                if(IDdark==-1)
-                {
-                    for(iiout=0; iiout<size_x; iiout++)
-                        for(jjout=0; jjout<size_y; jjout++)
-                        {
-                            iiin = xstart + iiout;
-                            jjin = ystart + jjout;
-                            data.image[IDout].array.F[jjout*size_x+iiout] = data.image[IDin].array.F[jjin*data.image[IDin].md[0].size[0]+iiin];
-                        }
-                }
+                if(binfact == 1)
+                    memcpy(outrow, rowacc, sizeof(float)*size_x);
                 else
-                {
-                    for(iiout=0; iiout<size_x; iiout++)
-                        for(jjout=0; jjout<size_y; jjout++)
-                        {
-                            iiin = xstart + iiout;
-                            jjin = ystart + jjout;
-                            data.image[IDout].array.F[jjout*size_x+iiout] = data.image[IDin].array.F[jjin*data.image[IDin].md[0].size[0]+iiin] - data.image[IDdark].array.F[jjin*data.image[IDdark].md[0].size[0]+iiin];
-                        }
-                }
-
-                if(IDmask!=-1)
-                    for(ii=0; ii<sizeoutxy; ii++)
-                        data.image[IDout].array.F[ii] *= data.image[IDmask].array.F[ii];
-
-                data.image[IDout].md[0].cnt0 = cnt0;
-                data.image[IDout].md[0].write = 0;
-                COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+                    for(iiout=0; iiout<size_xout; iiout++)
+                    {
+                        float v = 0.0;
+                        for(ib=0; ib<binfact; ib++)
+                            v += rowacc[iiout*binfact+ib];
+                        outrow[iiout] = v;
+                    }
+            }
+
+            if(binscale != 1.0)
+                for(ii=0; ii<sizeoutxy; ii++)
+                    outacc[ii] *= binscale;
+
+            if(IDmask!=-1)
+                for(ii=0; ii<sizeoutxy; ii++)
+                    outacc[ii] *= data.image[IDmask].array.F[ii];
+
+            // round and saturate integer outputs
+            switch (datatypeout) {
+            case _DATATYPE_UINT16 :
+                for(ii=0; ii<sizeoutxy; ii++)
+                    data.image[IDout].array.UI16[ii] = (uint16_t) (fminf(fmaxf(outacc[ii], 0.0f), 65535.0f) + 0.5f);
+                break;
+            case _DATATYPE_INT16 :
+                for(ii=0; ii<sizeoutxy; ii++)
+                    data.image[IDout].array.SI16[ii] = (int16_t) lrintf(fminf(fmaxf(outacc[ii], -32768.0f), 32767.0f));
+                break;
             }
+
+            data.image[IDout].md[0].cnt0 = cnt0;
+            data.image[IDout].md[0].write = 0;
+            COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
         }
-        break;
-    default :
-        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
-        exit(0);
-        break;
     }
-    free(sizeout);
+
+    free(rowacc);
+    if(outaccbuff != NULL)
+        free(outaccbuff);
 
     return(0);
 }
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include "statistic/statistic.h"
 #include "CommandLineInterface/CLIcore.h"
 #include "00CORE/00CORE.h"
@@ -35,6 +38,8 @@
 
 #include "fft/fft.h"
 
+#include <fftw3.h>
+
 /* =============================================================================================== */
 /* =============================================================================================== */
 /*                                      DEFINES, MACROS                                            */
@@ -49,6 +54,19 @@
 # endif
 
 
+// number of elements processed per block when converting input streams to float
+#define DATASTREAM_BLOCKSIZE 1024
+
+// imAlignStream frame selection gain (inverse of timescale in frames)
+#define IMALIGN_SELGAIN 0.01
+
+// stream3Dto2D photon noise : Poisson mean above which normal approximation is used
+#define STREAM3DTO2D_POISSON_NORMALTHRESH 30.0
+
+// frameDelay : interval between reconnect attempts while kernel stream is absent [ns]
+#define FRAMEDELAY_RECONNECT_NS 100000000
+
+
 
 
 /* =============================================================================================== */
@@ -134,6 +152,157 @@ extern AOloopControl_var aoloopcontrol_var; // declared in AOloopControl.c
 
 
 
+/**
+ * @brief Convert n elements of image array, starting at element offset, to float
+ *
+ * Used by stream processing functions to read input streams of any real datatype.\n
+ * One contiguous loop per datatype, vectorized by compiler.
+ */
+static void datastream_read_float(
+    IMAGE         *img,
+    long           offset,
+    long           n,
+    float *restrict dst
+)
+{
+    long ii;
+
+    switch (img->md[0].datatype) {
+    case _DATATYPE_UINT8 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.UI8[offset+ii];
+        break;
+    case _DATATYPE_INT8 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.SI8[offset+ii];
+        break;
+    case _DATATYPE_UINT16 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.UI16[offset+ii];
+        break;
+    case _DATATYPE_INT16 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.SI16[offset+ii];
+        break;
+    case _DATATYPE_UINT32 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.UI32[offset+ii];
+        break;
+    case _DATATYPE_INT32 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.SI32[offset+ii];
+        break;
+    case _DATATYPE_UINT64 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.UI64[offset+ii];
+        break;
+    case _DATATYPE_INT64 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.SI64[offset+ii];
+        break;
+    case _DATATYPE_FLOAT :
+        memcpy(dst, img->array.F + offset, sizeof(float)*n);
+        break;
+    case _DATATYPE_DOUBLE :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) img->array.D[offset+ii];
+        break;
+    }
+}
+
+
+/** @brief Returns 1 if datastream_read_float() can read datatype, 0 otherwise */
+static int datastream_datatype_supported(uint8_t datatype)
+{
+    switch (datatype) {
+    case _DATATYPE_UINT8 :
+    case _DATATYPE_INT8 :
+    case _DATATYPE_UINT16 :
+    case _DATATYPE_INT16 :
+    case _DATATYPE_UINT32 :
+    case _DATATYPE_INT32 :
+    case _DATATYPE_UINT64 :
+    case _DATATYPE_INT64 :
+    case _DATATYPE_FLOAT :
+    case _DATATYPE_DOUBLE :
+        return 1;
+    }
+    return 0;
+}
+
+
+/** @brief Flush pending posts of input semaphore semindex (no-op if -1) */
+static void datastream_flush_sem(long IDin, int semindex)
+{
+    int semval;
+    int i;
+
+    if(semindex < 0)
+        return;
+
+    sem_getvalue(data.image[IDin].semptr[semindex], &semval);
+    for(i=0; i<semval; i++)
+        ImageStreamIO_semtrywait(&data.image[IDin], semindex);
+}
+
+
+/**
+ * @brief Select input semaphore and flush it
+ *
+ * Returns semaphore index to wait on, or -1 if the stream has no semaphore
+ * (caller should then poll cnt0).
+ */
+static int datastream_init_semwait(long IDin, int insem)
+{
+    int semindex = -1;
+
+    if(data.image[IDin].md[0].sem > 0)
+    {
+        semindex = ImageStreamIO_getsemwaitindex(&data.image[IDin], insem);
+        datastream_flush_sem(IDin, semindex);
+    }
+
+    return semindex;
+}
+
+
+/**
+ * @brief Wait for next input frame
+ *
+ * Waits on semaphore semindex if >-1, otherwise polls cnt0 against *cntp.\n
+ * Updates *cntp to current input cnt0.
+ */
+static void datastream_wait_frame(long IDin, int semindex, uint64_t *cntp)
+{
+    if(semindex > -1)
+        ImageStreamIO_semwait(&data.image[IDin], semindex);
+    else
+        while(*cntp == data.image[IDin].md[0].cnt0) // test if new frame exists
+            usleep(5);
+
+    *cntp = data.image[IDin].md[0].cnt0;
+}
+
+
+/**
+ * @brief Wait for input frame with cnt0 different from *cntp
+ *
+ * Same as datastream_wait_frame(), but semaphore posts that do not bring a new frame
+ * (posts accumulated while the caller was busy, for a frame already read) are skipped,
+ * so that the same frame is never returned twice.
+ */
+static void datastream_wait_newframe(long IDin, int semindex, uint64_t *cntp)
+{
+    uint64_t cnt = *cntp;
+
+    do
+        datastream_wait_frame(IDin, semindex, cntp);
+    while(*cntp == cnt);
+}
+
+
+
+
 /* =============================================================================================== */
 /* =============================================================================================== */
 /** @name AOloopControl_IOtools - 3. DATA STREAMS PROCESSING      
@@ -170,6 +339,17 @@ extern AOloopControl_var aoloopcontrol_var; // declared in AOloopControl.c
  * 			Stream name for output RMS component
  * 
  * 
+ * ## Details
+ * 
+ * Input can be any real datatype, outputs are float.\n
+ * Waits on input semaphore (falls back to polling cnt0 if input has no semaphore),
+ * and posts semaphores of all three outputs.\n
+ * Uses exponentially weighted Welford update, with delta = new image - old average :\n
+ * average  += alpha * delta\n
+ * variance  = (1-alpha) * (variance + alpha * delta * delta)\n
+ * The RMS output holds the variance (square of RMS).\n
+ * Average is initialized to first frame.\n
+ * Frame is processed in blocks of DATASTREAM_BLOCKSIZE elements, converted to float in a local buffer.
  * 
  */
 
@@ -179,9 +359,12 @@ int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, co
     long IDout_ave;
     long IDout_AC, IDout_RMS;
     long xsize, ysize;
+    long nelem;
     uint32_t *sizearray;
-    long cnt0old = 0;
-    long delayus = 10;
+    uint64_t cnt0old;
+    int semindex;
+    int initframe = 1;
+    float alphaf = alpha;
 
 
 
@@ -189,6 +372,13 @@ int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, co
     IDin = image_ID(IDname);
     xsize = data.image[IDin].md[0].size[0];
     ysize = data.image[IDin].md[0].size[1];
+    nelem = xsize*ysize;
+
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
 
     sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
     sizearray[0] = xsize;
@@ -198,7 +388,7 @@ int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, co
     COREMOD_MEMORY_image_set_createsem(IDname_out_ave, 10);
 
     IDout_AC = create_image_ID(IDname_out_AC, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
-    COREMOD_MEMORY_image_set_createsem(IDname_out_ave, 10);
+    COREMOD_MEMORY_image_set_createsem(IDname_out_AC, 10);
 
     IDout_RMS = create_image_ID(IDname_out_RMS, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
     COREMOD_MEMORY_image_set_createsem(IDname_out_RMS, 10);
@@ -206,29 +396,67 @@ int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, co
 
     free(sizearray);
 
+    semindex = datastream_init_semwait(IDin, 1);
+    cnt0old = data.image[IDin].md[0].cnt0;
+
     for(;;)
     {
-        if(data.image[IDin].md[0].cnt0 != cnt0old)
+        long blk;
+        float *restrict ave = data.image[IDout_ave].array.F;
+        float *restrict AC  = data.image[IDout_AC].array.F;
+        float *restrict var = data.image[IDout_RMS].array.F;
+
+        datastream_wait_frame(IDin, semindex, &cnt0old);
+
+        data.image[IDout_ave].md[0].write = 1;
+        data.image[IDout_AC].md[0].write = 1;
+        data.image[IDout_RMS].md[0].write = 1;
+
+# ifdef _OPENMP
+        #pragma omp parallel for if (nelem>OMP_NELEMENT_LIMIT)
+# endif
+        for(blk=0; blk<nelem; blk+=DATASTREAM_BLOCKSIZE)
         {
-            data.image[IDout_ave].md[0].write = 1;
-            data.image[IDout_AC].md[0].write = 1;
-            data.image[IDout_RMS].md[0].write = 1;
-            uint_fast64_t ii;
-            for(ii=0; ii<xsize*ysize; ii++)
+            float frame[DATASTREAM_BLOCKSIZE];
+            long n = nelem-blk;
+            long ii;
+
+            if(n > DATASTREAM_BLOCKSIZE)
+                n = DATASTREAM_BLOCKSIZE;
+            datastream_read_float(&data.image[IDin], blk, n, frame);
+
+            if(initframe == 1)
             {
-                data.image[IDout_ave].array.F[ii] = (1.0-alpha)*data.image[IDout_ave].array.F[ii] + alpha * data.image[IDin].array.F[ii];
-                data.image[IDout_RMS].array.F[ii] = (1.0-alpha)*data.image[IDout_RMS].array.F[ii] + alpha * (data.image[IDin].array.F[ii] - data.image[IDout_ave].array.F[ii]) * (data.image[IDin].array.F[ii] - data.image[IDout_ave].array.F[ii]);
-                data.image[IDout_AC].array.F[ii] = data.image[IDin].array.F[ii] - data.image[IDout_ave].array.F[ii];
+                for(ii=0; ii<n; ii++)
+                {
+                    ave[blk+ii] = frame[ii];
+                    var[blk+ii] = 0.0;
+                    AC[blk+ii] = 0.0;
+                }
+            }
+            else
+            {
+                for(ii=0; ii<n; ii++)
+                {
+                    float delta = frame[ii] - ave[blk+ii];
+
+                    ave[blk+ii] += alphaf*delta;
+                    var[blk+ii] = (1.0f-alphaf)*(var[blk+ii] + alphaf*delta*delta);
+                    AC[blk+ii] = frame[ii] - ave[blk+ii];
+                }
             }
-            data.image[IDout_ave].md[0].cnt0++;
-            data.image[IDout_AC].md[0].cnt0++;
-            data.image[IDout_RMS].md[0].cnt0++;
-            data.image[IDout_ave].md[0].write = 0;
-            data.image[IDout_AC].md[0].write = 0;
-            data.image[IDout_RMS].md[0].write = 0;
-            cnt0old = data.image[IDin].md[0].cnt0;
         }
-        usleep(delayus);
+        initframe = 0;
+
+        data.image[IDout_ave].md[0].cnt0++;
+        data.image[IDout_AC].md[0].cnt0++;
+        data.image[IDout_RMS].md[0].cnt0++;
+        data.image[IDout_ave].md[0].write = 0;
+        data.image[IDout_AC].md[0].write = 0;
+        data.image[IDout_RMS].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout_ave, -1);
+        COREMOD_MEMORY_image_set_sempost_byID(IDout_AC, -1);
+        COREMOD_MEMORY_image_set_sempost_byID(IDout_RMS, -1);
     }
 
 
@@ -243,278 +471,2847 @@ int_fast8_t AOloopControl_IOtools_AveStream(const char *IDname, double alpha, co
 /**
  * ## Purpose
  * 
- * Align image stream in real-time\n
+ * Averages input image stream over multiple timescales in a single pass
  * 
  * ## Arguments
  * 
- * IDname is input stream \n
- * The alignment is computed using a rectangular box of starting at (xbox0,ybox0)\n
- * Reference image used for alignment is provided by IDref_name\n
- * 
- * 
- * ## Use
+ * @param[in]
+ * IDname	CHAR*
+ * 			Input stream name
  * 
- * Function runs a loop. Reacts to updates to stream IDname\n
+ * @param[in]
+ * NBalpha	INT
+ * 			Number of averaging coefficients (max AVESTREAM_MAXNBALPHA)
  * 
+ * @param[in]
+ * alpha	DOUBLE*
+ * 			Averaging coefficients, one per timescale
  * 
- * ## Details
+ * @param[out]
+ * IDname_out_ave	CHAR*
+ * 			Stream name for output averages
  * 
+ * @param[out]
+ * IDname_out_RMS	CHAR*
+ * 			Stream name for output variances, "null" if not needed
  * 
- * @return number of iteration [int]
+ * @param[in]
+ * outmode	INT
+ * 			0: single 3D output stream, slice k for alpha[k]\n
+ * 			1: separate 2D output streams <IDname_out_ave>_<k>
  * 
  * 
+ * ## Details
  * 
+ * Same update as AOloopControl_IOtools_AveStream(), applied to all coefficients
+ * while the converted input block is in cache, so the input frame is read only once.
  * 
- * \ingroup RTfunctions
  */
 
-
-int_fast8_t AOloopControl_IOtools_imAlignStream(
-    const char    *IDname,
-    int      xbox0,
-    int      ybox0,
-    const char    *IDref_name,
-    const char    *IDout_name,
-    int      insem
+int_fast8_t AOloopControl_IOtools_AveStreamBank(
+    const char   *IDname,
+    int           NBalpha,
+    const double *alpha,
+    const char   *IDname_out_ave,
+    const char   *IDname_out_RMS,
+    int           outmode
 )
 {
-    uint32_t IDin, IDref, IDtmp;
-    uint32_t xboxsize, yboxsize;
-    uint32_t xsize, ysize;
-    long cnt;
+    long IDin;
+    long IDout_ave[AVESTREAM_MAXNBALPHA];
+    long IDout_RMS[AVESTREAM_MAXNBALPHA];
+    int NBout;
+    float *aveptr[AVESTREAM_MAXNBALPHA];
+    float *varptr[AVESTREAM_MAXNBALPHA];
+    float alphaf[AVESTREAM_MAXNBALPHA];
+    int RMSmode = 1;
+    long xsize, ysize;
+    long nelem;
+    uint32_t *sizearray;
+    uint64_t cnt0old;
+    int semindex;
+    int initframe = 1;
+    int k;
 
-    long IDdark;
 
-    float xoffset, yoffset;
+    if((NBalpha < 1)||(NBalpha > AVESTREAM_MAXNBALPHA))
+    {
+        printf("ERROR: number of averaging coefficients = %d, should be 1 to %d\n", NBalpha, AVESTREAM_MAXNBALPHA);
+        exit(0);
+    }
+    for(k=0; k<NBalpha; k++)
+        alphaf[k] = alpha[k];
+
+    if(strcmp(IDname_out_RMS, "null") == 0)
+        RMSmode = 0;
 
     IDin = image_ID(IDname);
     xsize = data.image[IDin].md[0].size[0];
     ysize = data.image[IDin].md[0].size[1];
+    nelem = xsize*ysize;
 
-    IDref = image_ID(IDref_name);
-    xboxsize = data.image[IDref].md[0].size[0];
-    yboxsize = data.image[IDref].md[0].size[1];
-
-    // is there a dark ?
-    IDdark = image_ID("dark");
-
-
-    IDtmp = create_2Dimage_ID("imAlign_tmp", xboxsize, yboxsize);
-
-    // dark-subtracted full frame image
-    uint32_t IDin1;
-    IDin1 = create_2Dimage_ID("alignintmpim", xsize, ysize);
-
-    uint8_t datatype;
-    datatype = data.image[IDin].md[0].datatype;
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
 
-	// create output stream
-	uint32_t IDout;
-	uint32_t *sizearray;
-    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*3);
     sizearray[0] = xsize;
     sizearray[1] = ysize;
-    IDout = create_image_ID(IDout_name, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
-    COREMOD_MEMORY_image_set_createsem(IDout_name, 10);
-    free(sizearray);
+    sizearray[2] = NBalpha;
 
-
-
-    for(;;)
+    if(outmode == 0)
     {
-        if(IDdark != -1)
+        NBout = 1;
+        IDout_ave[0] = create_image_ID(IDname_out_ave, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
+        COREMOD_MEMORY_image_set_createsem(IDname_out_ave, 10);
+        if(RMSmode == 1)
         {
-            if(datatype == _DATATYPE_FLOAT)
-            {
-                long ii;
-                for(ii=0; ii<xsize*ysize; ii++)
-                    data.image[IDin1].array.F[ii] = data.image[IDin].array.F[ii] - data.image[IDdark].array.F[ii];
-            }
-            if(datatype == _DATATYPE_INT16)
-            {
-                long ii;
-                for(ii=0; ii<xsize*ysize; ii++)
-                    data.image[IDin1].array.F[ii] = 1.0*data.image[IDin].array.SI16[ii] - data.image[IDdark].array.F[ii];
-            }
+            IDout_RMS[0] = create_image_ID(IDname_out_RMS, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
+            COREMOD_MEMORY_image_set_createsem(IDname_out_RMS, 10);
         }
-        else
+        for(k=0; k<NBalpha; k++)
         {
-            if(datatype == _DATATYPE_FLOAT)
-            {
-                long ii;
-                for(ii=0; ii<xsize*ysize; ii++)
-                    data.image[IDin1].array.F[ii] = data.image[IDin].array.F[ii];
-            }
-            if(datatype == _DATATYPE_INT16)
-            {
-                long ii;
-                for(ii=0; ii<xsize*ysize; ii++)
-                    data.image[IDin1].array.F[ii] = 1.0*data.image[IDin].array.SI16[ii];
-            }
+            aveptr[k] = data.image[IDout_ave[0]].array.F + k*nelem;
+            if(RMSmode == 1)
+                varptr[k] = data.image[IDout_RMS[0]].array.F + k*nelem;
         }
+    }
+    else
+    {
+        NBout = NBalpha;
+        for(k=0; k<NBalpha; k++)
+        {
+            char imname[200];
 
+            if(sprintf(imname, "%s_%d", IDname_out_ave, k) < 1)
+                printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
+            IDout_ave[k] = create_image_ID(imname, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+            COREMOD_MEMORY_image_set_createsem(imname, 10);
+            aveptr[k] = data.image[IDout_ave[k]].array.F;
 
-
-        if(data.image[IDin].md[0].sem==0)
-        {
-            while(cnt==data.image[IDin].md[0].cnt0) // test if new frame exists
-                usleep(5);
-            cnt = data.image[IDin].md[0].cnt0;
+            if(RMSmode == 1)
+            {
+                if(sprintf(imname, "%s_%d", IDname_out_RMS, k) < 1)
+                    printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
+                IDout_RMS[k] = create_image_ID(imname, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+                COREMOD_MEMORY_image_set_createsem(imname, 10);
+                varptr[k] = data.image[IDout_RMS[k]].array.F;
+            }
         }
-        else
-            sem_wait(data.image[IDin].semptr[insem]);
-
+    }
 
+    free(sizearray);
 
+    semindex = datastream_init_semwait(IDin, 1);
+    cnt0old = data.image[IDin].md[0].cnt0;
 
-        // copy box into tmp image
-        long ii, jj;
+    for(;;)
+    {
+        long blk;
 
-        for(ii=0; ii<xboxsize; ii++)
-            for(jj=0; jj<yboxsize; jj++)
-            {
-                long ii1, jj1;
+        datastream_wait_frame(IDin, semindex, &cnt0old);
 
-                ii1 = ii + xbox0;
-                jj1 = jj + ybox0;
-                data.image[IDtmp].array.F[jj*xboxsize+ii] = 1.0*data.image[IDin1].array.F[jj1*xsize+ii1];
-            }
+        for(k=0; k<NBout; k++)
+        {
+            data.image[IDout_ave[k]].md[0].write = 1;
+            if(RMSmode == 1)
+                data.image[IDout_RMS[k]].md[0].write = 1;
+        }
 
+# ifdef _OPENMP
+        #pragma omp parallel for if (nelem>OMP_NELEMENT_LIMIT)
+# endif
+        for(blk=0; blk<nelem; blk+=DATASTREAM_BLOCKSIZE)
+        {
+            float frame[DATASTREAM_BLOCKSIZE];
+            long n = nelem-blk;
+            long ii;
+            int kk;
 
-        // compute cross correlation
-        fft_correlation("imAlign_tmp", IDref_name, "tmpCorr");
+            if(n > DATASTREAM_BLOCKSIZE)
+                n = DATASTREAM_BLOCKSIZE;
+            datastream_read_float(&data.image[IDin], blk, n, frame);
 
-        // find the correlation peak
-        float vmax = 0.0;
-        long ID;
-        long xoffset0, yoffset0;
-        ID = image_ID("tmpCorr");
-        for(ii=0; ii<xboxsize; ii++)
-            for(jj=0; jj<yboxsize; jj++)
+            for(kk=0; kk<NBalpha; kk++)
             {
-                if(data.image[ID].array.F[jj*xboxsize+ii] > vmax)
+                float *restrict ave = aveptr[kk] + blk;
+                float a = alphaf[kk];
+
+                if(initframe == 1)
                 {
-                    vmax = data.image[ID].array.F[jj*xboxsize+ii];
-                    xoffset0 = ii;
-                    yoffset0 = jj;
+                    memcpy(ave, frame, sizeof(float)*n);
+                    if(RMSmode == 1)
+                        memset(varptr[kk] + blk, 0, sizeof(float)*n);
                 }
-            }
-
-        xoffset = 1.0*xoffset0;
-        yoffset = 1.0*yoffset0;
-        float krad;
-        krad = 0.2*xboxsize;
-        float krad2;
-        krad2 = krad*krad;
-
-        int kiter;
-        int NBkiter = 3;
-        for(kiter=0; kiter<NBkiter; kiter++)
-        {
-            double tmpxs = 0.0;
-            double tmpys = 0.0;
-            double tmps = 0.0;
-            for(ii=0; ii<xboxsize; ii++)
-                for(jj=0; jj<yboxsize; jj++)
+                else if(RMSmode == 1)
+                {
+                    float *restrict var = varptr[kk] + blk;
+                    for(ii=0; ii<n; ii++)
+                    {
+                        float delta = frame[ii] - ave[ii];
+
+                        ave[ii] += a*delta;
+                        var[ii] = (1.0f-a)*(var[ii] + a*delta*delta);
+                    }
+                }
+                else
                 {
-                    float dx, dy, dx2, dy2;
-                    float kcoeff;
-
-                    dx = 1.0*ii - xoffset;
-                    dy = 1.0*jj - yoffset;
-                    dx2 = dx*dx;
-                    dy2 = dy*dy;
-                    kcoeff = exp(-(dx2+dy2)/krad2);
-
-                    tmpxs += kcoeff*ii*data.image[ID].array.F[jj*xboxsize+ii];
-                    tmpys += kcoeff*jj*data.image[ID].array.F[jj*xboxsize+ii];
-                    tmps += kcoeff*data.image[ID].array.F[jj*xboxsize+ii];
+                    for(ii=0; ii<n; ii++)
+                        ave[ii] += a*(frame[ii] - ave[ii]);
                 }
-            xoffset = tmpxs/tmps;
-            yoffset = tmpys/tmps;
-          //  printf("%2d center = %4.2f %4.2f\n", kiter, xoffset, yoffset);
+            }
         }
-        delete_image_ID("tmpCorr");
-
-
-        xoffset = - (xoffset - 0.5*xboxsize);
-        yoffset = - (yoffset - 0.5*yboxsize);
-
-       // printf("offset = %4.2f %4.2f\n", xoffset, yoffset);
-       // fflush(stdout);
-
-        fft_image_translate("alignintmpim", "alignouttmp", xoffset, yoffset);
-        
-        // write to IDout
-        long IDouttmp;
-        long framesize = sizeof(float)*xsize*ysize;
-        IDouttmp = image_ID("alignouttmp");
-        data.image[IDout].md[0].write = 1;
-        memcpy(data.image[IDout].array.F, data.image[IDouttmp].array.F, framesize);
-        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
-        data.image[IDout].md[0].cnt0++;
-        data.image[IDout].md[0].write = 0;
-
+        initframe = 0;
 
-        delete_image_ID("alignouttmp");
+        for(k=0; k<NBout; k++)
+        {
+            data.image[IDout_ave[k]].md[0].cnt0++;
+            data.image[IDout_ave[k]].md[0].write = 0;
+            COREMOD_MEMORY_image_set_sempost_byID(IDout_ave[k], -1);
+            if(RMSmode == 1)
+            {
+                data.image[IDout_RMS[k]].md[0].cnt0++;
+                data.image[IDout_RMS[k]].md[0].write = 0;
+                COREMOD_MEMORY_image_set_sempost_byID(IDout_RMS[k], -1);
+            }
+        }
     }
-    delete_image_ID("alignintmpim");
-    delete_image_ID("imAlign_tmp");
 
-    return 0;
-}
 
+    return(0);
+}
 
 
 
 
 
+/**
+ * ## Purpose
+ * 
+ * Sliding-window statistics of input image stream over last NBwin frames
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Input stream name
+ * 
+ * @param[in]
+ * NBwin	LONG
+ * 			Window size [frames]
+ * 
+ * @param[out]
+ * IDname_out_ave	CHAR*
+ * 			Stream name for output boxcar average
+ * 
+ * @param[out]
+ * IDname_out_RMS	CHAR*
+ * 			Stream name for output boxcar variance (square of RMS)
+ * 
+ * @param[in]
+ * NBpct	INT
+ * 			Number of percentiles to track (0 for none, max WINDOWSTAT_MAXNBPCT)
+ * 
+ * @param[in]
+ * pct		DOUBLE*
+ * 			Percentiles, as fractions (0.5 = median)
+ * 
+ * @param[out]
+ * IDname_out_pct	CHAR*
+ * 			Stream name for output percentiles, 3D, one slice per percentile
+ * 
+ * 
+ * ## Details
+ * 
+ * Last NBwin frames are kept in a float ring buffer. Average and variance are updated
+ * in O(1) per frame with sliding-window Welford update (add new frame, remove oldest frame),
+ * using double precision accumulators to avoid drift.\n
+ * During the first NBwin frames, the window contains all frames received so far.\n
+ * Percentiles are approximate, tracked per element by stochastic approximation :\n
+ * q += gain * sigma * (p - (x<q))\n
+ * where sigma is the window RMS and gain = 2/NBwin, so that the estimate follows
+ * the distribution over a timescale of order NBwin frames.
+ * 
+ */
 
-long AOloopControl_IOtools_frameDelay(
-	const char *IDin_name, 
-	const char *IDkern_name, 
-	const char *IDout_name, 
-	int insem
-	)
+int_fast8_t AOloopControl_IOtools_WindowStatStream(
+    const char   *IDname,
+    long          NBwin,
+    const char   *IDname_out_ave,
+    const char   *IDname_out_RMS,
+    int           NBpct,
+    const double *pct,
+    const char   *IDname_out_pct
+)
 {
-    long IDout;
     long IDin;
-    long IDkern;
-    long ksize;
-    long IDbuff;
+    long IDout_ave, IDout_RMS;
+    long IDout_pct = -1;
     long xsize, ysize;
-    long kindex = 0;
-    long cnt;
-    long framesize;
-    long IDtmp;
-    long xysize;
-    float eps=1.0e-8;
-    long ii, jj, kk, k1;
+    long nelem;
     uint32_t *sizearray;
+    uint64_t cnt0old;
+    int semindex;
+    float *ringbuff;
+    double *wmean;
+    double *wM2;
+    float pctf[WINDOWSTAT_MAXNBPCT];
+    float pctgain;
+    long ringindex = 0;
+    long NBframe = 0;  // number of frames in window
+    int k;
+
+
+    if(NBwin < 1)
+    {
+        printf("ERROR: window size %ld should be >= 1\n", NBwin);
+        exit(0);
+    }
+    if((NBpct < 0)||(NBpct > WINDOWSTAT_MAXNBPCT))
+    {
+        printf("ERROR: number of percentiles = %d, should be 0 to %d\n", NBpct, WINDOWSTAT_MAXNBPCT);
+        exit(0);
+    }
+    for(k=0; k<NBpct; k++)
+        pctf[k] = pct[k];
+    pctgain = 2.0/NBwin;
 
-
-
-    IDin = image_ID(IDin_name);
+    IDin = image_ID(IDname);
     xsize = data.image[IDin].md[0].size[0];
     ysize = data.image[IDin].md[0].size[1];
-    IDtmp = create_2Dimage_ID("_tmpfr", xsize, ysize);
-    xysize = xsize*ysize;
+    nelem = xsize*ysize;
 
-    printf("xsize = %ld\n", xsize);
-    printf("ysize = %ld\n", ysize);
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*3);
+    sizearray[0] = xsize;
+    sizearray[1] = ysize;
+    sizearray[2] = NBpct;
+
+    IDout_ave = create_image_ID(IDname_out_ave, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDname_out_ave, 10);
+
+    IDout_RMS = create_image_ID(IDname_out_RMS, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDname_out_RMS, 10);
+
+    if(NBpct > 0)
+    {
+        IDout_pct = create_image_ID(IDname_out_pct, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
+        COREMOD_MEMORY_image_set_createsem(IDname_out_pct, 10);
+    }
+
+    free(sizearray);
+
+
+    ringbuff = (float*) malloc(sizeof(float)*nelem*NBwin);
+    wmean = (double*) calloc(nelem, sizeof(double));
+    wM2 = (double*) calloc(nelem, sizeof(double));
+    if((ringbuff == NULL)||(wmean == NULL)||(wM2 == NULL))
+    {
+        printf("ERROR: cannot allocate window buffer (%ld frames x %ld elements)\n", NBwin, nelem);
+        exit(0);
+    }
+
+
+    semindex = datastream_init_semwait(IDin, 1);
+    cnt0old = data.image[IDin].md[0].cnt0;
+
+    for(;;)
+    {
+        long blk;
+        int windowfull;
+        double NBframeinv;
+
+        datastream_wait_frame(IDin, semindex, &cnt0old);
+
+        windowfull = (NBframe == NBwin);
+        if(windowfull == 0)
+            NBframe++;
+        NBframeinv = 1.0/NBframe;
+
+        data.image[IDout_ave].md[0].write = 1;
+        data.image[IDout_RMS].md[0].write = 1;
+        if(IDout_pct != -1)
+            data.image[IDout_pct].md[0].write = 1;
+
+# ifdef _OPENMP
+        #pragma omp parallel for if (nelem>OMP_NELEMENT_LIMIT)
+# endif
+        for(blk=0; blk<nelem; blk+=DATASTREAM_BLOCKSIZE)
+        {
+            float frame[DATASTREAM_BLOCKSIZE];
+            float *restrict slot = ringbuff + ringindex*nelem + blk; // oldest frame if window is full
+            float *restrict ave = data.image[IDout_ave].array.F + blk;
+            float *restrict var = data.image[IDout_RMS].array.F + blk;
+            double *restrict mean = wmean + blk;
+            double *restrict M2 = wM2 + blk;
+            long n = nelem-blk;
+            long ii;
+            int kk;
+
+            if(n > DATASTREAM_BLOCKSIZE)
+                n = DATASTREAM_BLOCKSIZE;
+            datastream_read_float(&data.image[IDin], blk, n, frame);
+
+            if(windowfull == 1)
+            {
+                // replace oldest frame by new frame
+                for(ii=0; ii<n; ii++)
+                {
+                    double xnew = frame[ii];
+                    double xold = slot[ii];
+                    double meanold = mean[ii];
+
+                    mean[ii] += (xnew - xold)*NBframeinv;
+                    M2[ii] += (xnew - xold)*(xnew - mean[ii] + xold - meanold);
+                }
+            }
+            else
+            {
+                // add new frame
+                for(ii=0; ii<n; ii++)
+                {
+                    double xnew = frame[ii];
+                    double delta = xnew - mean[ii];
+
+                    mean[ii] += delta*NBframeinv;
+                    M2[ii] += delta*(xnew - mean[ii]);
+                }
+            }
+            memcpy(slot, frame, sizeof(float)*n);
+
+            for(ii=0; ii<n; ii++)
+            {
+                ave[ii] = (float) mean[ii];
+                var[ii] = (M2[ii] > 0.0) ? (float) (M2[ii]*NBframeinv) : 0.0f;
+            }
+
+            for(kk=0; kk<NBpct; kk++)
+            {
+                float *restrict q = data.image[IDout_pct].array.F + kk*nelem + blk;
+                float p = pctf[kk];
+
+                if(NBframe == 1)
+                    memcpy(q, frame, sizeof(float)*n);
+                else
+                    for(ii=0; ii<n; ii++)
+                    {
+                        float step = pctgain*sqrtf(var[ii]);
+                        float below = (frame[ii] < q[ii]) ? 1.0f : 0.0f;
+
+                        q[ii] += step*(p - below);
+                    }
+            }
+        }
+
+        ringindex++;
+        if(ringindex == NBwin)
+            ringindex = 0;
+
+        data.image[IDout_ave].md[0].cnt0++;
+        data.image[IDout_RMS].md[0].cnt0++;
+        data.image[IDout_ave].md[0].write = 0;
+        data.image[IDout_RMS].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout_ave, -1);
+        COREMOD_MEMORY_image_set_sempost_byID(IDout_RMS, -1);
+        if(IDout_pct != -1)
+        {
+            data.image[IDout_pct].md[0].cnt0++;
+            data.image[IDout_pct].md[0].write = 0;
+            COREMOD_MEMORY_image_set_sempost_byID(IDout_pct, -1);
+        }
+    }
+
+    free(ringbuff);
+    free(wmean);
+    free(wM2);
+
+    return(0);
+}
+
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Compute temporal power spectral density of all elements of input stream
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Input stream name
+ * 
+ * @param[in]
+ * NBframe	LONG
+ * 			Welch averaging time span [frames]
+ * 
+ * @param[in]
+ * seglen	LONG
+ * 			Welch segment length [frames]
+ * 
+ * @param[in]
+ * NBupdate	LONG
+ * 			PSD is published every NBupdate input frames (rounded up to the next segment end)
+ * 
+ * @param[out]
+ * IDname_out	CHAR*
+ * 			Output PSD stream, 2D : x = element index, y = frequency index
+ * 
+ * 
+ * ## Details
+ * 
+ * Welch estimate : Hann-windowed segments of seglen frames, 50% overlap, spanning the
+ * last NBframe frames.\n
+ * Frequency index k corresponds to k/seglen times the frame rate, k = 0 ... seglen/2.\n
+ * PSD is one-sided, normalized so that its sum over frequency is the signal variance
+ * (frame rate = 1).\n
+ * Capture is continuous : the last seglen frames are kept in a ring buffer, and every
+ * seglen/2 frames the spectrum of the segment just completed is computed once and stored
+ * in a ring of NBseg segment spectra. A running sum over the stored spectra is updated by
+ * adding the new spectrum and subtracting the one it replaces, so the cost is one FFT per
+ * seglen/2 frames, independent of NBframe and NBupdate.\n
+ * All elements are transformed with a single batched real FFT plan, created once
+ * with FFTW_MEASURE. Time axis is strided by the number of elements so that each
+ * windowed frame is a contiguous copy.\n
+ * A frame is only recorded if its cnt0 differs from the previous one, so that no
+ * frame is recorded twice.
+ * 
+ */
+
+long AOloopControl_IOtools_TemporalPSDStream(
+    const char *IDname,
+    long        NBframe,
+    long        seglen,
+    long        NBupdate,
+    const char *IDname_out
+)
+{
+    long IDin, IDout;
+    long xsize, ysize;
+    long nelem;
+    long NBfreq;
+    long NBseg;
+    long segstep;
+    uint32_t *sizearray;
+    uint64_t cnt0old;
+    int semindex;
+    float *ringbuff;
+    float *win;
+    float *fftin;
+    fftwf_complex *fftout;
+    fftwf_plan psdplan;
+    int fftlen;
+    float *psdseg;        // ring of NBseg segment spectra, nelem x NBfreq each
+    double *psdsum;       // sum of stored segment spectra
+    double winnorm;
+    long ringindex = 0;   // next slot to write (oldest frame once ring is full)
+    long NBframerec = 0;  // number of frames recorded, saturates at seglen
+    long segcnt = 0;      // frames since last segment end
+    long segindex = 0;    // next slot of segment spectra ring
+    long NBsegrec = 0;    // number of segment spectra stored, saturates at NBseg
+    long updatecnt = 0;
+    long ii, kk, t;
+
+
+    if((seglen < 4)||(seglen > NBframe)||(NBupdate < 1))
+    {
+        printf("ERROR: need 4 <= seglen (%ld) <= NBframe (%ld), and NBupdate (%ld) >= 1\n", seglen, NBframe, NBupdate);
+        exit(0);
+    }
+    segstep = seglen/2;
+    NBseg = (NBframe-seglen)/segstep + 1;
+    NBfreq = seglen/2 + 1;
+
+    IDin = image_ID(IDname);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    if(data.image[IDin].md[0].naxis < 2)
+        ysize = 1;
+    nelem = xsize*ysize;
+
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+
+    printf("PSD: %ld elements, %ld segments of %ld frames, %ld frequencies\n", nelem, NBseg, seglen, NBfreq);
     fflush(stdout);
 
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    sizearray[0] = nelem;
+    sizearray[1] = NBfreq;
+    IDout = create_image_ID(IDname_out, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDname_out, 10);
+    free(sizearray);
+
+
+    ringbuff = (float*) malloc(sizeof(float)*nelem*seglen);
+    psdseg = (float*) malloc(sizeof(float)*nelem*NBfreq*NBseg);
+    psdsum = (double*) calloc(nelem*NBfreq, sizeof(double));
+    win = (float*) malloc(sizeof(float)*seglen);
+    fftin = (float*) fftwf_malloc(sizeof(float)*nelem*seglen);
+    fftout = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*nelem*NBfreq);
+    if((ringbuff == NULL)||(psdseg == NULL)||(psdsum == NULL)||(win == NULL)||(fftin == NULL)||(fftout == NULL))
+    {
+        printf("ERROR: cannot allocate PSD buffers\n");
+        exit(0);
+    }
+
+    // Hann window
+    winnorm = 0.0;
+    for(t=0; t<seglen; t++)
+    {
+        win[t] = 0.5 - 0.5*cos(2.0*M_PI*t/seglen);
+        winnorm += win[t]*win[t];
+    }
+
+
+    // one real FFT per element, time index strided by nelem
+    fftlen = (int) seglen;
+    psdplan = fftwf_plan_many_dft_r2c(1, &fftlen, (int) nelem,
+                                      fftin, NULL, (int) nelem, 1,
+                                      fftout, NULL, (int) nelem, 1,
+                                      FFTW_MEASURE);
+
+
+    semindex = datastream_init_semwait(IDin, 1);
+    cnt0old = data.image[IDin].md[0].cnt0;
+
+    for(;;)
+    {
+        long blk;
+        float *restrict spec;
+
+        datastream_wait_newframe(IDin, semindex, &cnt0old);
+
+        for(blk=0; blk<nelem; blk+=DATASTREAM_BLOCKSIZE)
+        {
+            long n = nelem-blk;
+
+            if(n > DATASTREAM_BLOCKSIZE)
+                n = DATASTREAM_BLOCKSIZE;
+            datastream_read_float(&data.image[IDin], blk, n, ringbuff + ringindex*nelem + blk);
+        }
+        ringindex++;
+        if(ringindex == seglen)
+            ringindex = 0;
+        if(NBframerec < seglen)
+            NBframerec++;
+        if(updatecnt < NBupdate)
+            updatecnt++;
+
+        segcnt++;
+        if((segcnt < segstep)||(NBframerec < seglen))
+            continue;
+        segcnt = 0;
+
+
+        // spectrum of segment just completed (last seglen frames, oldest at ringindex)
+        for(t=0; t<seglen; t++)
+        {
+            const float *restrict frame = ringbuff + ((ringindex+t)%seglen)*nelem;
+            float *restrict dst = fftin + t*nelem;
+            float w = win[t];
+
+            for(ii=0; ii<nelem; ii++)
+                dst[ii] = w*frame[ii];
+        }
+
+        fftwf_execute(psdplan);
+
+        // replace oldest stored spectrum, update running sum
+        spec = psdseg + segindex*nelem*NBfreq;
+        for(kk=0; kk<NBfreq; kk++)
+        {
+            const float *restrict src = (const float*) (fftout + kk*nelem);
+            float *restrict dst = spec + kk*nelem;
+            double *restrict sum = psdsum + kk*nelem;
+
+            for(ii=0; ii<nelem; ii++)
+            {
+                float p = src[2*ii]*src[2*ii] + src[2*ii+1]*src[2*ii+1];
+
+                if(NBsegrec == NBseg)
+                    sum[ii] -= dst[ii];
+                sum[ii] += p;
+                dst[ii] = p;
+            }
+        }
+        segindex++;
+        if(segindex == NBseg)
+            segindex = 0;
+        if(NBsegrec < NBseg)
+            NBsegrec++;
+
+        if((updatecnt < NBupdate)||(NBsegrec < NBseg))
+            continue;
+        updatecnt = 0;
+
+
+        data.image[IDout].md[0].write = 1;
+        for(kk=0; kk<NBfreq; kk++)
+        {
+            double coeff = 2.0/(winnorm*seglen*NBseg);
+
+            if((kk == 0)||((seglen%2 == 0)&&(kk == NBfreq-1))) // DC and Nyquist are not doubled
+                coeff *= 0.5;
+
+            for(ii=0; ii<nelem; ii++)
+            {
+                double v = coeff*psdsum[kk*nelem+ii];
+
+                if(v < 0.0) // rounding residual of running sum
+                    v = 0.0;
+                data.image[IDout].array.F[kk*nelem+ii] = (float) v;
+            }
+        }
+        data.image[IDout].md[0].cnt0++;
+        data.image[IDout].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+    }
+
+
+    fftwf_destroy_plan(psdplan);
+    fftwf_free(fftin);
+    fftwf_free(fftout);
+    free(ringbuff);
+    free(psdseg);
+    free(psdsum);
+    free(win);
+
+    return IDout;
+}
+
+
+
+
+
+/**
+ * @brief Add input frame, binned by xbin x ybin (sum), to accumulator acc (xsizeb x ysizeb)
+ *
+ * row is a scratch buffer of xsize floats.
+ */
+static void displaystream_accumulate(
+    long   IDin,
+    long   xsize,
+    long   xsizeb,
+    long   ysizeb,
+    int    xbin,
+    int    ybin,
+    float *row,
+    float *acc
+)
+{
+    long iib, jjb;
+    int ib, jb;
+
+    for(jjb=0; jjb<ysizeb; jjb++)
+        for(jb=0; jb<ybin; jb++)
+        {
+            float *restrict accrow = acc + jjb*xsizeb;
+
+            datastream_read_float(&data.image[IDin], (jjb*ybin+jb)*xsize, xsize, row);
+            for(iib=0; iib<xsizeb; iib++)
+                for(ib=0; ib<xbin; ib++)
+                    accrow[iib] += row[iib*xbin+ib];
+        }
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Low-rate, binned copy of data stream for display
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Input stream name, any real datatype
+ * 
+ * @param[out]
+ * IDname_out	CHAR*
+ * 			Output stream name (FLOAT), size = input size / binfact
+ * 
+ * @param[in]
+ * binfact	INT
+ * 			Spatial binning factor (output is mean over binfact x binfact pixels, binfact pixels for 1D input)
+ * 
+ * @param[in]
+ * avemode	INT
+ * 			0 : decimation, latest input frame is published\n
+ * 			1 : temporal averaging of all input frames since last update
+ * 
+ * @param[in]
+ * rate		FLOAT
+ * 			Output update rate [Hz]
+ * 
+ * @param[in]
+ * insem	INT
+ * 			Input semaphore index (averaging mode only)
+ * 
+ * @param[in]
+ * cpu		INT
+ * 			CPU the process is pinned to, -1 for no pinning
+ * 
+ * 
+ * ## Details
+ * 
+ * Meant for GUIs and viewers, which attach to the output stream instead of real-time streams.\n
+ * The process runs at lowest priority (nice 19), optionally pinned to a non real-time CPU.\n
+ * Decimation mode does not wait on input semaphores : every 1/rate s, the latest input frame
+ * is read if cnt0 changed. The frame is discarded if it was written during the copy.\n
+ * Averaging mode waits on input semaphore insem to accumulate every frame, and publishes the
+ * mean every 1/rate s. A frame is accumulated only if cnt0 advanced since the last accumulated
+ * frame, and is discarded if it was written during the read.\n
+ * Output cnt1 is the input cnt0 of the last frame included.
+ * 
+ */
+
+long AOloopControl_IOtools_DisplayStream(
+    const char *IDname,
+    const char *IDname_out,
+    int         binfact,
+    int         avemode,
+    float       rate,
+    int         insem,
+    int         cpu
+)
+{
+    long IDin, IDout;
+    long xsize, ysize;
+    long xsizeb, ysizeb;
+    long nelemb;
+    int ybin;
+    uint32_t *sizearray;
+    float *row;
+    float *acc;
+    float *accframe = NULL;   // binned frame being read (averaging mode)
+    long NBacc = 0;
+    uint64_t cnt0old = 0;
+    uint64_t cnt0last = 0;
+    int semindex = -1;
+    struct timespec tnext;
+    long period_ns;
+    long ii;
+
+
+    IDin = image_ID(IDname);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    if(data.image[IDin].md[0].naxis < 2)
+        ysize = 1;
+
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+    if((binfact < 1)||(binfact > xsize)||((ysize > 1)&&(binfact > ysize))||(rate <= 0.0))
+    {
+        printf("ERROR: need 1 <= binfact (%d) <= image size, and rate (%f) > 0\n", binfact, rate);
+        exit(0);
+    }
+
+    ybin = (ysize > 1) ? binfact : 1;
+    xsizeb = xsize/binfact;
+    ysizeb = ysize/ybin;
+    nelemb = xsizeb*ysizeb;
+    period_ns = (long) (1.0e9/rate);
+
+
+    // low priority, optionally away from real-time CPUs
+    if(setpriority(PRIO_PROCESS, 0, 19) != 0)
+        printf("WARNING: cannot lower process priority\n");
+    if(cpu > -1)
+    {
+        cpu_set_t mask;
+
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        if(sched_setaffinity(0, sizeof(mask), &mask) != 0)
+            printf("WARNING: cannot set CPU affinity to CPU %d\n", cpu);
+    }
+
+
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    sizearray[0] = xsizeb;
+    sizearray[1] = ysizeb;
+    IDout = create_image_ID(IDname_out, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDname_out, 10);
+    free(sizearray);
+
+    row = (float*) malloc(sizeof(float)*xsize);
+    acc = (float*) calloc(nelemb, sizeof(float));
+    if((row == NULL)||(acc == NULL))
+    {
+        printf("ERROR: cannot allocate display buffers\n");
+        exit(0);
+    }
+
+    if(avemode == 1)
+    {
+        semindex = datastream_init_semwait(IDin, insem);
+        accframe = (float*) malloc(sizeof(float)*nelemb);
+        if(accframe == NULL)
+        {
+            printf("ERROR: cannot allocate display buffers\n");
+            exit(0);
+        }
+        cnt0last = data.image[IDin].md[0].cnt0;
+    }
+    cnt0old = data.image[IDin].md[0].cnt0;
+
+    clock_gettime(CLOCK_MONOTONIC, &tnext);
+
+    for(;;)
+    {
+        struct timespec tnow;
+
+        tnext.tv_nsec += period_ns;
+        while(tnext.tv_nsec >= 1000000000)
+        {
+            tnext.tv_nsec -= 1000000000;
+            tnext.tv_sec++;
+        }
+
+        if(avemode == 1)
+        {
+            // accumulate all frames until next update time
+            for(;;)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &tnow);
+                if((tnow.tv_sec > tnext.tv_sec)||((tnow.tv_sec == tnext.tv_sec)&&(tnow.tv_nsec >= tnext.tv_nsec)))
+                    break;
+
+                if(semindex > -1)
+                {
+                    if(ImageStreamIO_semtrywait(&data.image[IDin], semindex) != 0)
+                    {
+                        usleep(100);
+                        continue;
+                    }
+                }
+                else if(data.image[IDin].md[0].cnt0 == cnt0last)
+                {
+                    usleep(100);
+                    continue;
+                }
+
+                // skip posts of frames already accumulated, and frames being written
+                cnt0old = data.image[IDin].md[0].cnt0;
+                if((cnt0old == cnt0last)||(data.image[IDin].md[0].write == 1))
+                    continue;
+
+                memset(accframe, 0, sizeof(float)*nelemb);
+                displaystream_accumulate(IDin, xsize, xsizeb, ysizeb, binfact, ybin, row, accframe);
+                if((data.image[IDin].md[0].write == 0)&&(data.image[IDin].md[0].cnt0 == cnt0old))
+                {
+                    for(ii=0; ii<nelemb; ii++)
+                        acc[ii] += accframe[ii];
+                    NBacc++;
+                    cnt0last = cnt0old;
+                }
+            }
+        }
+        else
+        {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tnext, NULL);
+
+            cnt0old = data.image[IDin].md[0].cnt0;
+            if((cnt0old != cnt0last)&&(data.image[IDin].md[0].write == 0))
+            {
+                memset(acc, 0, sizeof(float)*nelemb);
+                displaystream_accumulate(IDin, xsize, xsizeb, ysizeb, binfact, ybin, row, acc);
+                if((data.image[IDin].md[0].write == 0)&&(data.image[IDin].md[0].cnt0 == cnt0old))
+                {
+                    NBacc = 1;
+                    cnt0last = cnt0old;
+                }
+            }
+        }
+
+        if(NBacc > 0)
+        {
+            float coeff = 1.0/(NBacc*binfact*ybin);
+
+            data.image[IDout].md[0].write = 1;
+            for(ii=0; ii<nelemb; ii++)
+                data.image[IDout].array.F[ii] = coeff*acc[ii];
+            data.image[IDout].md[0].cnt1 = cnt0last;
+            data.image[IDout].md[0].cnt0++;
+            data.image[IDout].md[0].write = 0;
+            COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+
+            memset(acc, 0, sizeof(float)*nelemb);
+            NBacc = 0;
+        }
+    }
+
+    free(row);
+    free(acc);
+    free(accframe);
+
+    return IDout;
+}
+
+
+
+
+/**
+ * @brief Take a snapshot of the filter bank coefficients, normalized by a0
+ *
+ * Coefficient stream IDcoeff is 2D : x = element index (nelem), y = coefficient index,
+ * b0 ... bN then a0 ... aN.\n
+ * Coefficients are written into coeff as b0..bN, a1..aN (divided by a0), each coefficient
+ * contiguous over elements.\n
+ * a0 is a caller-provided buffer of nelem floats.\n
+ * Returns 0 if the snapshot is consistent, 1 if the stream was written during the copy (retry),
+ * 2 if the coefficients are rejected (a0 = 0): in both last cases coeff content must not be used,
+ * and a rejected update should not be retried until cnt0 changes.\n
+ * Coefficient stream cnt0 at snapshot time is written in *cnt0p.
+ */
+static int iirfilt_coeff_snapshot(
+    long            IDcoeff,
+    long            nelem,
+    long            order,
+    float          *coeff,
+    float *restrict a0,
+    uint64_t       *cnt0p
+)
+{
+    uint64_t cnt0;
+    long NBcoeff = 2*order+1;
+    long ii, k;
+
+    cnt0 = data.image[IDcoeff].md[0].cnt0;
+    *cnt0p = cnt0;
+    if(data.image[IDcoeff].md[0].write == 1)
+        return 1;
+
+    datastream_read_float(&data.image[IDcoeff], 0, (order+1)*nelem, coeff);
+    datastream_read_float(&data.image[IDcoeff], (order+1)*nelem, nelem, a0);
+    datastream_read_float(&data.image[IDcoeff], (order+2)*nelem, order*nelem, coeff + (order+1)*nelem);
+
+    if((data.image[IDcoeff].md[0].write == 1)||(data.image[IDcoeff].md[0].cnt0 != cnt0))
+        return 1;
+
+    for(ii=0; ii<nelem; ii++)
+        if(a0[ii] == 0.0)
+        {
+            printf("WARNING: a0 = 0 for element %ld, coefficients update %lu rejected\n", ii, (unsigned long) cnt0);
+            return 2;
+        }
+
+    for(k=0; k<NBcoeff; k++)
+        for(ii=0; ii<nelem; ii++)
+            coeff[k*nelem+ii] /= a0[ii];
+
+    return 0;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Per-element IIR filter bank on data stream
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Input stream name, any real datatype
+ * 
+ * @param[in]
+ * IDcoeff_name	CHAR*
+ * 			Coefficient stream name, 2D : x = element index, y = b0 ... bN, a0 ... aN
+ * 
+ * @param[out]
+ * IDname_out	CHAR*
+ * 			Output stream name (FLOAT), same size as input
+ * 
+ * @param[in]
+ * insem	INT
+ * 			Input semaphore index
+ * 
+ * 
+ * ## Details
+ * 
+ * Each element i of the input stream (pixel or mode) is filtered by its own filter :\n
+ * a0 y[n] = b0 x[n] + ... + bN x[n-N] - a1 y[n-1] - ... - aN y[n-N]\n
+ * Filter order N = (number of coefficient rows)/2 - 1. An FIR filter has a1 ... aN = 0.\n
+ * Direct form II transposed : N state values per element, stored as N arrays contiguous
+ * over elements (structure of arrays), so that each filter step is a vectorized loop
+ * over a block of elements. Output is written directly into the output stream.\n
+ * Hot-swap : when the coefficient stream cnt0 changes, coefficients are copied into the
+ * inactive buffer between frames, and the buffers are swapped before the next frame if the
+ * copy is consistent. Filter state is kept.
+ * 
+ * \ingroup RTfunctions
+ */
+
+int_fast8_t AOloopControl_IOtools_IIRfilterStream(
+    const char *IDname,
+    const char *IDcoeff_name,
+    const char *IDname_out,
+    int         insem
+)
+{
+    long IDin, IDcoeff, IDout;
+    long xsize, ysize;
+    long nelem;
+    long order;
+    long NBcoeff;
+    uint32_t *sizearray;
+    uint64_t cnt0old = 0;
+    uint64_t coeffcnt0;
+    uint64_t coeffrejcnt0;   // cnt0 of last rejected coefficient update
+    int coeffstatus;
+    int semindex;
+    float *coeffbuff[2];
+    float *a0buff;
+    int coeffindex = 0;   // active coefficient buffer
+    float *state;
+
+
+    IDin = image_ID(IDname);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    if(data.image[IDin].md[0].naxis < 2)
+        ysize = 1;
+    nelem = xsize*ysize;
+
+    IDcoeff = image_ID(IDcoeff_name);
+    if((datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)||(datastream_datatype_supported(data.image[IDcoeff].md[0].datatype) == 0))
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+    if((data.image[IDcoeff].md[0].naxis != 2)||(data.image[IDcoeff].md[0].size[0] != nelem)||(data.image[IDcoeff].md[0].size[1] < 2)||(data.image[IDcoeff].md[0].size[1] % 2 != 0))
+    {
+        printf("ERROR: coefficient stream must be %ld x 2(N+1)\n", nelem);
+        exit(0);
+    }
+    order = data.image[IDcoeff].md[0].size[1]/2 - 1;
+    NBcoeff = 2*order+1;
+
+    printf("IIR filter bank: %ld elements, order %ld\n", nelem, order);
+    fflush(stdout);
+
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    sizearray[0] = xsize;
+    sizearray[1] = ysize;
+    IDout = create_image_ID(IDname_out, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDname_out, 10);
+    free(sizearray);
+
+
+    coeffbuff[0] = (float*) malloc(sizeof(float)*NBcoeff*nelem);
+    coeffbuff[1] = (float*) malloc(sizeof(float)*NBcoeff*nelem);
+    a0buff = (float*) malloc(sizeof(float)*nelem);
+    state = (float*) calloc(order*nelem+1, sizeof(float));
+    if((coeffbuff[0] == NULL)||(coeffbuff[1] == NULL)||(a0buff == NULL)||(state == NULL))
+    {
+        printf("ERROR: cannot allocate filter buffers\n");
+        exit(0);
+    }
+
+    // initial coefficients : retry torn snapshots, wait for a new update if rejected
+    while((coeffstatus = iirfilt_coeff_snapshot(IDcoeff, nelem, order, coeffbuff[coeffindex], a0buff, &coeffcnt0)) != 0)
+    {
+        if(coeffstatus == 2)
+            while(data.image[IDcoeff].md[0].cnt0 == coeffcnt0)
+                usleep(100);
+        else
+            usleep(100);
+    }
+    coeffrejcnt0 = coeffcnt0;
+
+
+    semindex = datastream_init_semwait(IDin, insem);
+
+    for(;;)
+    {
+        long blk;
+        const float *coeff;
+
+        datastream_wait_frame(IDin, semindex, &cnt0old);
+
+        coeff = coeffbuff[coeffindex];
+
+        data.image[IDout].md[0].write = 1;
+
+# ifdef _OPENMP
+        #pragma omp parallel for if (nelem*order>OMP_NELEMENT_LIMIT)
+# endif
+        for(blk=0; blk<nelem; blk+=DATASTREAM_BLOCKSIZE)
+        {
+            float frame[DATASTREAM_BLOCKSIZE];
+            float *restrict y = data.image[IDout].array.F + blk;
+            long n = nelem-blk;
+            long ii, k;
+
+            if(n > DATASTREAM_BLOCKSIZE)
+                n = DATASTREAM_BLOCKSIZE;
+            datastream_read_float(&data.image[IDin], blk, n, frame);
+
+            if(order == 0)
+            {
+                const float *restrict b0 = coeff + blk;
+                for(ii=0; ii<n; ii++)
+                    y[ii] = b0[ii]*frame[ii];
+                continue;
+            }
+
+            {
+                const float *restrict b0 = coeff + blk;
+                const float *restrict z0 = state + blk;
+                for(ii=0; ii<n; ii++)
+                    y[ii] = b0[ii]*frame[ii] + z0[ii];
+            }
+            for(k=0; k<order; k++)
+            {
+                const float *restrict bk = coeff + (k+1)*nelem + blk;
+                const float *restrict ak = coeff + (order+1+k)*nelem + blk;
+                float *restrict zk = state + k*nelem + blk;
+
+                if(k < order-1)
+                {
+                    const float *restrict zk1 = state + (k+1)*nelem + blk;
+                    for(ii=0; ii<n; ii++)
+                        zk[ii] = bk[ii]*frame[ii] - ak[ii]*y[ii] + zk1[ii];
+                }
+                else
+                    for(ii=0; ii<n; ii++)
+                        zk[ii] = bk[ii]*frame[ii] - ak[ii]*y[ii];
+            }
+        }
+
+        data.image[IDout].md[0].cnt1 = data.image[IDin].md[0].cnt0;
+        data.image[IDout].md[0].cnt0++;
+        data.image[IDout].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+
+
+        // coefficient hot-swap, between frames
+        // (an update rejected for a0 = 0 is not retried until the coefficient stream changes)
+        if((data.image[IDcoeff].md[0].cnt0 != coeffcnt0)&&(data.image[IDcoeff].md[0].cnt0 != coeffrejcnt0))
+        {
+            uint64_t newcnt0;
+
+            coeffstatus = iirfilt_coeff_snapshot(IDcoeff, nelem, order, coeffbuff[1-coeffindex], a0buff, &newcnt0);
+            if(coeffstatus == 0)
+            {
+                coeffindex = 1-coeffindex;
+                coeffcnt0 = newcnt0;
+            }
+            else if(coeffstatus == 2)
+                coeffrejcnt0 = newcnt0;
+        }
+    }
+
+    free(coeffbuff[0]);
+    free(coeffbuff[1]);
+    free(a0buff);
+    free(state);
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief FFT cross-correlator
+ *
+ * Correlates image in with a fixed reference, whose conjugate spectrum is cached.\n
+ * Buffers are allocated and plans created once, in imalign_corr_init().
+ */
+typedef struct
+{
+    uint32_t       xsize;
+    uint32_t       ysize;
+    float         *in;        // image to correlate
+    fftwf_complex *spec;      // image spectrum, ysize x (xsize/2+1)
+    fftwf_complex *refspec;   // conjugate of reference spectrum, normalized
+    float         *corrraw;   // cross-correlation, zero shift at pixel (0,0)
+    float         *corr;      // cross-correlation, zero shift at pixel (xsize/2, ysize/2)
+    fftwf_plan     plan_fwd;
+    fftwf_plan     plan_inv;
+} IMALIGN_CORRELATOR;
+
+
+
+
+/**
+ * @brief Image alignment engine
+ *
+ * Holds FFT plans and scratch buffers used by AOloopControl_IOtools_imAlignStream().\n
+ * All buffers are allocated and all plans are created once, in imalign_engine_init().\n
+ * Without pyramid registration, the full alignment box is correlated with the reference.\n
+ * With pyramid registration, the binned box is correlated with the binned reference
+ * (coarse shift), and a small full resolution window of the box, offset by the coarse shift,
+ * is correlated with the central window of the reference (fine shift).
+ */
+typedef struct
+{
+    int      fullframe;       // 1 if full frame buffers and plans are allocated (translation)
+    uint32_t xsize;           // full frame size
+    uint32_t ysize;
+    uint32_t xboxsize;        // alignment box size = reference size
+    uint32_t yboxsize;
+    long     xbox0;           // alignment box position in full frame
+    long     ybox0;
+
+    float         *fullin;    // dark-subtracted full frame
+    fftwf_complex *fullspec;  // full frame spectrum, ysize x (xsize/2+1)
+    fftwf_complex *rampx;     // translation phase ramps
+    fftwf_complex *rampy;
+    fftwf_plan     plan_full_fwd;
+    fftwf_plan     plan_full_inv;   // writes into output array
+
+    float         *boxin;     // alignment box
+    float         *refbuf;    // reference
+
+    int                pyrbin;  // coarse level binning factor, 1 if no pyramid registration
+    IMALIGN_CORRELATOR box;     // full alignment box (no pyramid registration)
+    IMALIGN_CORRELATOR coarse;  // binned alignment box
+    IMALIGN_CORRELATOR fine;    // full resolution window
+    uint32_t           xwin0;   // reference window position in box
+    uint32_t           ywin0;
+} IMALIGN_ENGINE;
+
+
+
+
+/** @brief Allocate correlator buffers and create FFT plans */
+static void imalign_corr_init(
+    IMALIGN_CORRELATOR *cor,
+    uint32_t            xsize,
+    uint32_t            ysize
+)
+{
+    long xfsize = xsize/2+1;
+
+    cor->xsize = xsize;
+    cor->ysize = ysize;
+
+    cor->in      = (float*)         fftwf_malloc(sizeof(float)*xsize*ysize);
+    cor->spec    = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*xfsize*ysize);
+    cor->refspec = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*xfsize*ysize);
+    cor->corrraw = (float*)         fftwf_malloc(sizeof(float)*xsize*ysize);
+    cor->corr    = (float*)         fftwf_malloc(sizeof(float)*xsize*ysize);
+
+    if((cor->in == NULL)||(cor->spec == NULL)||(cor->refspec == NULL)||(cor->corrraw == NULL)||(cor->corr == NULL))
+    {
+        printf("ERROR: cannot allocate alignment buffers\n");
+        exit(0);
+    }
+
+    cor->plan_fwd = fftwf_plan_dft_r2c_2d(ysize, xsize, cor->in, cor->spec, FFTW_MEASURE);
+    cor->plan_inv = fftwf_plan_dft_c2r_2d(ysize, xsize, cor->spec, cor->corrraw, FFTW_MEASURE);
+}
+
+
+
+
+/** @brief Compute and store conjugate spectrum of reference (xsize x ysize array, may be cor->in) */
+static void imalign_corr_setref(
+    IMALIGN_CORRELATOR *cor,
+    const float        *ref
+)
+{
+    long nbelem = cor->xsize*cor->ysize;
+    long nbfreq = (cor->xsize/2+1)*cor->ysize;
+    float norm = 1.0/nbelem;
+    long ii;
+
+    if(ref != cor->in)
+        memcpy(cor->in, ref, sizeof(float)*nbelem);
+    fftwf_execute(cor->plan_fwd);
+    for(ii=0; ii<nbfreq; ii++)
+    {
+        cor->refspec[ii][0] = norm*cor->spec[ii][0];
+        cor->refspec[ii][1] = -norm*cor->spec[ii][1];
+    }
+}
+
+
+
+
+/** @brief Cross-correlate cor->in with reference
+ *
+ * Result is written in cor->corr, with zero shift at pixel (xsize/2, ysize/2)
+ */
+static void imalign_corr_run(
+    IMALIGN_CORRELATOR *cor
+)
+{
+    uint32_t xsize = cor->xsize;
+    uint32_t ysize = cor->ysize;
+    long nbfreq = (xsize/2+1)*ysize;
+    uint32_t ii, jj;
+
+    fftwf_execute(cor->plan_fwd);
+
+    for(ii=0; ii<nbfreq; ii++)
+    {
+        float re = cor->spec[ii][0]*cor->refspec[ii][0] - cor->spec[ii][1]*cor->refspec[ii][1];
+        float im = cor->spec[ii][0]*cor->refspec[ii][1] + cor->spec[ii][1]*cor->refspec[ii][0];
+        cor->spec[ii][0] = re;
+        cor->spec[ii][1] = im;
+    }
+
+    fftwf_execute(cor->plan_inv);
+
+    // move zero shift to center
+    for(jj=0; jj<ysize; jj++)
+    {
+        uint32_t jj1 = (jj + ysize/2) % ysize;
+        uint32_t ishift = xsize/2;
+
+        memcpy(cor->corr + jj1*xsize + ishift, cor->corrraw + jj*xsize, sizeof(float)*(xsize-ishift));
+        memcpy(cor->corr + jj1*xsize, cor->corrraw + jj*xsize + (xsize-ishift), sizeof(float)*ishift);
+    }
+}
+
+
+
+
+/** @brief Free correlator buffers and plans */
+static void imalign_corr_free(
+    IMALIGN_CORRELATOR *cor
+)
+{
+    fftwf_destroy_plan(cor->plan_fwd);
+    fftwf_destroy_plan(cor->plan_inv);
+    fftwf_free(cor->in);
+    fftwf_free(cor->spec);
+    fftwf_free(cor->refspec);
+    fftwf_free(cor->corrraw);
+    fftwf_free(cor->corr);
+}
+
+
+
+
+/** @brief Allocate alignment engine buffers and create FFT plans
+ *
+ * outarray is the float array receiving translated frames (size xsize x ysize).\n
+ * If outarray is NULL, frames are not translated: only alignment box buffers and plans
+ * are created, and the box is read with imalign_engine_readbox().\n
+ * pyrlevel > 0 selects pyramid registration with binning factor 2^pyrlevel,
+ * and fine window size winsize (0 for automatic: 8 x binning factor, min 16).
+ */
+static void imalign_engine_init(
+    IMALIGN_ENGINE *eng,
+    uint32_t        xsize,
+    uint32_t        ysize,
+    uint32_t        xboxsize,
+    uint32_t        yboxsize,
+    long            xbox0,
+    long            ybox0,
+    int             pyrlevel,
+    uint32_t        winsize,
+    float          *outarray
+)
+{
+    long xfsize = xsize/2+1;
+
+    eng->fullframe = (outarray != NULL) ? 1 : 0;
+    eng->xsize = xsize;
+    eng->ysize = ysize;
+    eng->xboxsize = xboxsize;
+    eng->yboxsize = yboxsize;
+    eng->xbox0 = xbox0;
+    eng->ybox0 = ybox0;
+    eng->pyrbin = 1 << pyrlevel;
+
+    if((xboxsize % eng->pyrbin != 0)||(yboxsize % eng->pyrbin != 0))
+    {
+        printf("ERROR: alignment box size %u x %u is not a multiple of pyramid binning factor %d\n", xboxsize, yboxsize, eng->pyrbin);
+        exit(0);
+    }
+
+    eng->fullin   = NULL;
+    eng->fullspec = NULL;
+    eng->rampx    = NULL;
+    eng->rampy    = NULL;
+    if(eng->fullframe == 1)
+    {
+        eng->fullin   = (float*)         fftwf_malloc(sizeof(float)*xsize*ysize);
+        eng->fullspec = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*xfsize*ysize);
+        eng->rampx    = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*xfsize);
+        eng->rampy    = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*ysize);
+        if((eng->fullin == NULL)||(eng->fullspec == NULL)||(eng->rampx == NULL)||(eng->rampy == NULL))
+        {
+            printf("ERROR: cannot allocate alignment buffers\n");
+            exit(0);
+        }
+    }
+
+    eng->boxin  = (float*) fftwf_malloc(sizeof(float)*xboxsize*yboxsize);
+    eng->refbuf = (float*) fftwf_malloc(sizeof(float)*xboxsize*yboxsize);
+    if((eng->boxin == NULL)||(eng->refbuf == NULL))
+    {
+        printf("ERROR: cannot allocate alignment buffers\n");
+        exit(0);
+    }
+
+    printf("Creating FFT plans ...");
+    fflush(stdout);
+    if(eng->fullframe == 1)
+    {
+        eng->plan_full_fwd = fftwf_plan_dft_r2c_2d(ysize, xsize, eng->fullin, eng->fullspec, FFTW_MEASURE);
+        eng->plan_full_inv = fftwf_plan_dft_c2r_2d(ysize, xsize, eng->fullspec, outarray, FFTW_MEASURE);
+    }
+    if(eng->pyrbin == 1)
+        imalign_corr_init(&eng->box, xboxsize, yboxsize);
+    else
+    {
+        if(winsize == 0)
+        {
+            winsize = 8*eng->pyrbin;
+            if(winsize < 16)
+                winsize = 16;
+        }
+        if(winsize > xboxsize)
+            winsize = xboxsize;
+        if(winsize > yboxsize)
+            winsize = yboxsize;
+        eng->xwin0 = (xboxsize-winsize)/2;
+        eng->ywin0 = (yboxsize-winsize)/2;
+
+        imalign_corr_init(&eng->coarse, xboxsize/eng->pyrbin, yboxsize/eng->pyrbin);
+        imalign_corr_init(&eng->fine, winsize, winsize);
+    }
+    printf(" done\n");
+    fflush(stdout);
+}
+
+
+
+
+/** @brief Bin alignment box (xboxsize x yboxsize array) by pyramid binning factor into coarse correlator input */
+static void imalign_engine_bin(
+    IMALIGN_ENGINE *eng,
+    const float    *im
+)
+{
+    uint32_t xc = eng->coarse.xsize;
+    uint32_t yc = eng->coarse.ysize;
+    int bin = eng->pyrbin;
+    uint32_t ii, jj;
+    int ib, jb;
+
+    memset(eng->coarse.in, 0, sizeof(float)*xc*yc);
+    for(jj=0; jj<yc; jj++)
+        for(jb=0; jb<bin; jb++)
+        {
+            const float *restrict row = im + (jj*bin+jb)*eng->xboxsize;
+            float *restrict dst = eng->coarse.in + jj*xc;
+
+            for(ii=0; ii<xc; ii++)
+                for(ib=0; ib<bin; ib++)
+                    dst[ii] += row[ii*bin+ib];
+        }
+}
+
+
+
+
+/** @brief Copy winsize x winsize window at (x0,y0) of alignment box (xboxsize x yboxsize array) to dst */
+static void imalign_engine_window(
+    IMALIGN_ENGINE *eng,
+    const float    *im,
+    long            x0,
+    long            y0,
+    float          *dst
+)
+{
+    uint32_t winsize = eng->fine.xsize;
+    uint32_t jj;
+
+    for(jj=0; jj<winsize; jj++)
+        memcpy(dst + jj*winsize, im + (y0+jj)*eng->xboxsize + x0, sizeof(float)*winsize);
+}
+
+
+
+
+/** @brief Read reference and compute cached reference spectra */
+static void imalign_engine_setref(
+    IMALIGN_ENGINE *eng,
+    long            IDref
+)
+{
+    datastream_read_float(&data.image[IDref], 0, eng->xboxsize*eng->yboxsize, eng->refbuf);
+
+    if(eng->pyrbin == 1)
+        imalign_corr_setref(&eng->box, eng->refbuf);
+    else
+    {
+        imalign_engine_bin(eng, eng->refbuf);
+        imalign_corr_setref(&eng->coarse, eng->coarse.in);
+        imalign_engine_window(eng, eng->refbuf, eng->xwin0, eng->ywin0, eng->fine.in);
+        imalign_corr_setref(&eng->fine, eng->fine.in);
+    }
+}
+
+
+
+
+/** @brief Copy alignment box from eng->fullin into eng->boxin */
+static void imalign_engine_extractbox(
+    IMALIGN_ENGINE *eng
+)
+{
+    uint32_t jj;
+
+    for(jj=0; jj<eng->yboxsize; jj++)
+        memcpy(eng->boxin + jj*eng->xboxsize, eng->fullin + (jj+eng->ybox0)*eng->xsize + eng->xbox0, sizeof(float)*eng->xboxsize);
+}
+
+
+
+
+/** @brief Read alignment box from input stream into eng->boxin, dark-subtracted if IDdark != -1
+ *
+ * Used when frames are not translated, so that only the box is read from the input.
+ */
+static void imalign_engine_readbox(
+    IMALIGN_ENGINE *eng,
+    long            IDin,
+    long            IDdark
+)
+{
+    uint32_t ii, jj;
+
+    for(jj=0; jj<eng->yboxsize; jj++)
+    {
+        long offset = (jj+eng->ybox0)*eng->xsize + eng->xbox0;
+        float *restrict row = eng->boxin + jj*eng->xboxsize;
+
+        datastream_read_float(&data.image[IDin], offset, eng->xboxsize, row);
+        if(IDdark != -1)
+            for(ii=0; ii<eng->xboxsize; ii++)
+                row[ii] -= data.image[IDdark].array.F[offset+ii];
+    }
+}
+
+
+
+
+/** @brief Correlation value at (ii,jj), with periodic wrapping (correlation is circular) */
+static inline float imalign_corrval(
+    IMALIGN_CORRELATOR *cor,
+    long            ii,
+    long            jj
+)
+{
+    long xb = cor->xsize;
+    long yb = cor->ysize;
+
+    ii = ((ii % xb) + xb) % xb;
+    jj = ((jj % yb) + yb) % yb;
+
+    return cor->corr[jj*xb+ii];
+}
+
+
+
+
+/** @brief Iterative Gaussian-weighted centroid over the full box, starting at integer peak */
+static void imalign_peak_gausscentroid(
+    IMALIGN_CORRELATOR *cor,
+    long            xoffset0,
+    long            yoffset0,
+    float          *xpeak,
+    float          *ypeak
+)
+{
+    uint32_t xboxsize = cor->xsize;
+    uint32_t yboxsize = cor->ysize;
+    float *corr = cor->corr;
+    float xoffset, yoffset;
+    long ii, jj;
+
+    xoffset = 1.0*xoffset0;
+    yoffset = 1.0*yoffset0;
+    float krad;
+    krad = 0.2*xboxsize;
+    float krad2;
+    krad2 = krad*krad;
+
+    int kiter;
+    int NBkiter = 3;
+    for(kiter=0; kiter<NBkiter; kiter++)
+    {
+        double tmpxs = 0.0;
+        double tmpys = 0.0;
+        double tmps = 0.0;
+        for(ii=0; ii<xboxsize; ii++)
+            for(jj=0; jj<yboxsize; jj++)
+            {
+                float dx, dy, dx2, dy2;
+                float kcoeff;
+
+                dx = 1.0*ii - xoffset;
+                dy = 1.0*jj - yoffset;
+                dx2 = dx*dx;
+                dy2 = dy*dy;
+                kcoeff = exp(-(dx2+dy2)/krad2);
+
+                tmpxs += kcoeff*ii*corr[jj*xboxsize+ii];
+                tmpys += kcoeff*jj*corr[jj*xboxsize+ii];
+                tmps += kcoeff*corr[jj*xboxsize+ii];
+            }
+        xoffset = tmpxs/tmps;
+        yoffset = tmpys/tmps;
+    }
+
+    *xpeak = xoffset;
+    *ypeak = yoffset;
+}
+
+
+
+
+/** @brief Separable 3-point parabolic fit around integer peak */
+static void imalign_peak_parabolic(
+    IMALIGN_CORRELATOR *cor,
+    long            xoffset0,
+    long            yoffset0,
+    float          *xpeak,
+    float          *ypeak
+)
+{
+    float v0 = imalign_corrval(cor, xoffset0, yoffset0);
+    float vxm = imalign_corrval(cor, xoffset0-1, yoffset0);
+    float vxp = imalign_corrval(cor, xoffset0+1, yoffset0);
+    float vym = imalign_corrval(cor, xoffset0, yoffset0-1);
+    float vyp = imalign_corrval(cor, xoffset0, yoffset0+1);
+    float denom;
+
+    *xpeak = 1.0*xoffset0;
+    denom = vxm - 2.0*v0 + vxp;
+    if(denom < 0.0)
+        *xpeak += 0.5*(vxm - vxp)/denom;
+
+    *ypeak = 1.0*yoffset0;
+    denom = vym - 2.0*v0 + vyp;
+    if(denom < 0.0)
+        *ypeak += 0.5*(vym - vyp)/denom;
+}
+
+
+
+
+/** @brief 2D quadratic least-squares fit on (2r+1)x(2r+1) neighborhood of integer peak
+ *
+ * Fits a + b x + c y + d (x^2-m) + e xy + f (y^2-m), m = mean of x^2 over the grid,
+ * which makes all basis functions orthogonal on the square grid.\n
+ * Falls back to parabolic fit if fitted surface has no maximum within the neighborhood.
+ */
+static void imalign_peak_quadfit(
+    IMALIGN_CORRELATOR *cor,
+    long            xoffset0,
+    long            yoffset0,
+    int             r,
+    float          *xpeak,
+    float          *ypeak
+)
+{
+    long n = 2*r+1;
+    double m = 0.0;
+    double sx2 = 0.0;    // sum of x^2 over 1D grid
+    double sq2 = 0.0;    // sum of (x^2-m)^2 over 1D grid
+    double sb = 0.0, sc = 0.0, sd = 0.0, se = 0.0, sf = 0.0;
+    double b, c, d, e, f;
+    double det;
+    long i, j;
+
+    for(i=-r; i<=r; i++)
+        sx2 += i*i;
+    m = sx2/n;
+    for(i=-r; i<=r; i++)
+        sq2 += (i*i-m)*(i*i-m);
+
+    for(j=-r; j<=r; j++)
+        for(i=-r; i<=r; i++)
+        {
+            double v = imalign_corrval(cor, xoffset0+i, yoffset0+j);
+
+            sb += i*v;
+            sc += j*v;
+            sd += (i*i-m)*v;
+            se += i*j*v;
+            sf += (j*j-m)*v;
+        }
+
+    b = sb/(n*sx2);
+    c = sc/(n*sx2);
+    d = sd/(n*sq2);
+    e = se/(sx2*sx2);
+    f = sf/(n*sq2);
+
+    det = 4.0*d*f - e*e;
+    if((d < 0.0)&&(det > 0.0))
+    {
+        double dx = (-2.0*f*b + e*c)/det;
+        double dy = (-2.0*d*c + e*b)/det;
+
+        if((fabs(dx) <= r)&&(fabs(dy) <= r))
+        {
+            *xpeak = xoffset0 + dx;
+            *ypeak = yoffset0 + dy;
+            return;
+        }
+    }
+
+    imalign_peak_parabolic(cor, xoffset0, yoffset0, xpeak, ypeak);
+}
+
+
+
+
+/** @brief Centroid of (2r+1)x(2r+1) neighborhood of integer peak, minimum subtracted */
+static void imalign_peak_centroid(
+    IMALIGN_CORRELATOR *cor,
+    long            xoffset0,
+    long            yoffset0,
+    int             r,
+    float          *xpeak,
+    float          *ypeak
+)
+{
+    float vmin;
+    double sx = 0.0, sy = 0.0, s = 0.0;
+    long i, j;
+
+    vmin = imalign_corrval(cor, xoffset0, yoffset0);
+    for(j=-r; j<=r; j++)
+        for(i=-r; i<=r; i++)
+        {
+            float v = imalign_corrval(cor, xoffset0+i, yoffset0+j);
+            if(v < vmin)
+                vmin = v;
+        }
+
+    for(j=-r; j<=r; j++)
+        for(i=-r; i<=r; i++)
+        {
+            double v = imalign_corrval(cor, xoffset0+i, yoffset0+j) - vmin;
+
+            sx += i*v;
+            sy += j*v;
+            s += v;
+        }
+
+    *xpeak = 1.0*xoffset0;
+    *ypeak = 1.0*yoffset0;
+    if(s > 0.0)
+    {
+        *xpeak += sx/s;
+        *ypeak += sy/s;
+    }
+}
+
+
+
+
+/** @brief Find correlation peak in cor->corr, in pixel coordinates of corr array
+ *
+ * Integer peak, refined by subpixel estimator peakmode (IMALIGN_PEAK_*).\n
+ * Returns correlation value at integer peak.
+ */
+static float imalign_corr_peak(
+    IMALIGN_CORRELATOR *cor,
+    int             peakmode,
+    float          *xpeak,
+    float          *ypeak
+)
+{
+    uint32_t xboxsize = cor->xsize;
+    uint32_t yboxsize = cor->ysize;
+    long nelem = xboxsize*yboxsize;
+    float *corr = cor->corr;
+    float vmax;
+    long iimax = 0;
+    long ii;
+
+    vmax = corr[0];
+    for(ii=1; ii<nelem; ii++)
+        if(corr[ii] > vmax)
+        {
+            vmax = corr[ii];
+            iimax = ii;
+        }
+
+    switch (peakmode) {
+    case IMALIGN_PEAK_PARABOLIC :
+        imalign_peak_parabolic(cor, iimax%xboxsize, iimax/xboxsize, xpeak, ypeak);
+        break;
+    case IMALIGN_PEAK_QUADFIT3 :
+        imalign_peak_quadfit(cor, iimax%xboxsize, iimax/xboxsize, 1, xpeak, ypeak);
+        break;
+    case IMALIGN_PEAK_QUADFIT5 :
+        imalign_peak_quadfit(cor, iimax%xboxsize, iimax/xboxsize, 2, xpeak, ypeak);
+        break;
+    case IMALIGN_PEAK_CENTROID :
+        imalign_peak_centroid(cor, iimax%xboxsize, iimax/xboxsize, 2, xpeak, ypeak);
+        break;
+    default : // IMALIGN_PEAK_GAUSSCENTROID
+        imalign_peak_gausscentroid(cor, iimax%xboxsize, iimax/xboxsize, xpeak, ypeak);
+        break;
+    }
+
+    return vmax;
+}
+
+
+
+
+
+/** @brief Measure shift of alignment box eng->boxin relative to reference
+ *
+ * Shift (xshift, yshift) is in pixels, zero if box and reference are aligned.
+
+ * With pyramid registration, the coarse shift is measured on the binned box (parabolic peak fit),
+ * and refined by correlating the reference window with the box window offset by the coarse shift
+ * (subpixel estimator peakmode).
+
+ * Returns correlation value at integer peak of the last correlation.
+ */
+static float imalign_engine_measure(
+    IMALIGN_ENGINE *eng,
+    int             peakmode,
+    float          *xshift,
+    float          *yshift
+)
+{
+    float xpeak, ypeak;
+    float corrpeak;
+    long xs, ys;
+    long xsmin, xsmax, ysmin, ysmax;
+
+    if(eng->pyrbin == 1)
+    {
+        memcpy(eng->box.in, eng->boxin, sizeof(float)*eng->xboxsize*eng->yboxsize);
+        imalign_corr_run(&eng->box);
+        corrpeak = imalign_corr_peak(&eng->box, peakmode, &xpeak, &ypeak);
+        *xshift = xpeak - 0.5*eng->xboxsize;
+        *yshift = ypeak - 0.5*eng->yboxsize;
+        return corrpeak;
+    }
+
+    // coarse shift
+    imalign_engine_bin(eng, eng->boxin);
+    imalign_corr_run(&eng->coarse);
+    imalign_corr_peak(&eng->coarse, IMALIGN_PEAK_PARABOLIC, &xpeak, &ypeak);
+    xs = lroundf(eng->pyrbin*(xpeak - 0.5*eng->coarse.xsize));
+    ys = lroundf(eng->pyrbin*(ypeak - 0.5*eng->coarse.ysize));
+
+    // keep window within box
+    xsmin = -((long) eng->xwin0);
+    xsmax = (long) eng->xboxsize - (long) eng->fine.xsize - (long) eng->xwin0;
+    ysmin = -((long) eng->ywin0);
+    ysmax = (long) eng->yboxsize - (long) eng->fine.ysize - (long) eng->ywin0;
+    if(xs < xsmin)
+        xs = xsmin;
+    if(xs > xsmax)
+        xs = xsmax;
+    if(ys < ysmin)
+        ys = ysmin;
+    if(ys > ysmax)
+        ys = ysmax;
+
+    // fine shift
+    imalign_engine_window(eng, eng->boxin, eng->xwin0+xs, eng->ywin0+ys, eng->fine.in);
+    imalign_corr_run(&eng->fine);
+    corrpeak = imalign_corr_peak(&eng->fine, peakmode, &xpeak, &ypeak);
+    *xshift = xs + xpeak - 0.5*eng->fine.xsize;
+    *yshift = ys + ypeak - 0.5*eng->fine.ysize;
+
+    return corrpeak;
+}
+
+
+
+
+/** @brief Translate eng->fullin by (xoffset, yoffset) pixels into output array
+ *
+ * Fourier shift: spectrum multiplied by separable phase ramps, normalization included in ramp
+ */
+static void imalign_engine_translate(
+    IMALIGN_ENGINE *eng,
+    float           xoffset,
+    float           yoffset
+)
+{
+    uint32_t xsize = eng->xsize;
+    uint32_t ysize = eng->ysize;
+    long xfsize = xsize/2+1;
+    float norm = 1.0/(xsize*ysize);
+    long ii, jj;
+
+    fftwf_execute(eng->plan_full_fwd);
+
+    for(ii=0; ii<xfsize; ii++)
+    {
+        float pha = -2.0*M_PI*ii*xoffset/xsize;
+        eng->rampx[ii][0] = norm*cosf(pha);
+        eng->rampx[ii][1] = norm*sinf(pha);
+    }
+    for(jj=0; jj<ysize; jj++)
+    {
+        long kj = (jj < (ysize+1)/2) ? jj : (long) jj - (long) ysize;
+        float pha = -2.0*M_PI*kj*yoffset/ysize;
+        eng->rampy[jj][0] = cosf(pha);
+        eng->rampy[jj][1] = sinf(pha);
+    }
+
+    for(jj=0; jj<ysize; jj++)
+    {
+        fftwf_complex *restrict row = eng->fullspec + jj*xfsize;
+        float ry_re = eng->rampy[jj][0];
+        float ry_im = eng->rampy[jj][1];
+
+        for(ii=0; ii<xfsize; ii++)
+        {
+            float r_re = ry_re*eng->rampx[ii][0] - ry_im*eng->rampx[ii][1];
+            float r_im = ry_re*eng->rampx[ii][1] + ry_im*eng->rampx[ii][0];
+            float re = row[ii][0]*r_re - row[ii][1]*r_im;
+            float im = row[ii][0]*r_im + row[ii][1]*r_re;
+            row[ii][0] = re;
+            row[ii][1] = im;
+        }
+    }
+
+    fftwf_execute(eng->plan_full_inv);
+}
+
+
+
+
+/** @brief Free alignment engine buffers and plans */
+static void imalign_engine_free(
+    IMALIGN_ENGINE *eng
+)
+{
+    if(eng->fullframe == 1)
+    {
+        fftwf_destroy_plan(eng->plan_full_fwd);
+        fftwf_destroy_plan(eng->plan_full_inv);
+        fftwf_free(eng->fullin);
+        fftwf_free(eng->fullspec);
+        fftwf_free(eng->rampx);
+        fftwf_free(eng->rampy);
+    }
+    if(eng->pyrbin == 1)
+        imalign_corr_free(&eng->box);
+    else
+    {
+        imalign_corr_free(&eng->coarse);
+        imalign_corr_free(&eng->fine);
+    }
+
+    fftwf_free(eng->boxin);
+    fftwf_free(eng->refbuf);
+}
+
+
+
+
+
+
+/** @brief Frame selection state for shift-and-add (see imalign_select()) */
+typedef struct
+{
+    long  cnt;        // number of frames seen
+    float qmean;      // exponentially weighted mean of quality
+    float qvar;       // exponentially weighted variance of quality
+    float qthresh;    // running quality threshold
+} IMALIGN_SELECT;
+
+
+
+
+/** @brief Strehl proxy: maximum / sum over alignment box of translated frame */
+static float imalign_strehlproxy(
+    IMALIGN_ENGINE *eng,
+    const float    *frame
+)
+{
+    float vmax = 0.0;
+    double vsum = 0.0;
+    uint32_t ii, jj;
+
+    for(jj=0; jj<eng->yboxsize; jj++)
+    {
+        const float *row = frame + (jj+eng->ybox0)*eng->xsize + eng->xbox0;
+
+        for(ii=0; ii<eng->xboxsize; ii++)
+        {
+            vsum += row[ii];
+            if(row[ii] > vmax)
+                vmax = row[ii];
+        }
+    }
+
+    if(vsum > 0.0)
+        return vmax/vsum;
+    else
+        return 0.0;
+}
+
+
+
+
+/** @brief Decide if frame of given quality is kept
+ *
+ * Keeps approximately fraction selfrac of frames : threshold tracks the (1-selfrac)
+ * quantile of quality by stochastic approximation, with step scaled by quality RMS.\n
+ * Mean, variance and quantile follow a timescale of 1/IMALIGN_SELGAIN frames.\n
+ * Returns 1 if frame is kept, 0 otherwise.
+ */
+static int imalign_select(
+    IMALIGN_SELECT *sel,
+    float           quality,
+    float           selfrac
+)
+{
+    int accept;
+    float delta;
+
+    if(sel->cnt == 0)
+    {
+        sel->qmean = quality;
+        sel->qvar = 0.0;
+        sel->qthresh = quality;
+        sel->cnt++;
+        return 1;
+    }
+
+    accept = (quality >= sel->qthresh) ? 1 : 0;
+
+    delta = quality - sel->qmean;
+    sel->qmean += IMALIGN_SELGAIN*delta;
+    sel->qvar = (1.0-IMALIGN_SELGAIN)*(sel->qvar + IMALIGN_SELGAIN*delta*delta);
+    sel->qthresh += IMALIGN_SELGAIN*sqrtf(sel->qvar)*((1.0-selfrac) - ((quality < sel->qthresh) ? 1.0 : 0.0));
+    sel->cnt++;
+
+    return accept;
+}
+
+
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Align image stream in real-time\n
+ * 
+ * ## Arguments
+ * 
+ * IDname is input stream \n
+ * The alignment is computed using a rectangular box of starting at (xbox0,ybox0)\n
+ * Reference image used for alignment is provided by IDref_name\n
+ * 
+ * 
+ * ## Use
+ * 
+ * Function runs a loop. Reacts to updates to stream IDname\n
+ * 
+ * 
+ * ## Details
+ * 
+ * If image "dark" exists, it is subtracted from input frames.\n
+ * FFT plans and buffers are created once (see IMALIGN_ENGINE). The reference
+ * spectrum is cached, and recomputed only when the reference stream counter changes.
+ * Per frame, the box spectrum is multiplied by the reference spectrum and inverse
+ * transformed, and the full frame is Fourier-shifted directly into the output stream.
+ * 
+ * @return number of iteration [int]
+ * 
+ * 
+ * 
+ * 
+ * \ingroup RTfunctions
+ */
+
+
+int_fast8_t AOloopControl_IOtools_imAlignStream(
+    const char    *IDname,
+    int      xbox0,
+    int      ybox0,
+    const char    *IDref_name,
+    const char    *IDout_name,
+    int      insem
+)
+{
+    IMALIGN_OPTIONS opt;
+
+    AOloopControl_IOtools_imAlignStream_defaultoptions(&opt);
+
+    return AOloopControl_IOtools_imAlignStream_opt(IDname, xbox0, ybox0, IDref_name, IDout_name, insem, &opt);
+}
+
+
+
+
+/** @brief Set default alignment options (legacy behavior) */
+void AOloopControl_IOtools_imAlignStream_defaultoptions(
+    IMALIGN_OPTIONS *opt
+)
+{
+    opt->peakmode = IMALIGN_PEAK_GAUSSCENTROID;
+    opt->outmode = IMALIGN_OUT_IMAGE;
+    opt->SAname[0] = '\0';
+    opt->SANBframe = 0;
+    opt->selmode = IMALIGN_SEL_NONE;
+    opt->selfrac = 1.0;
+    opt->qualname[0] = '\0';
+    opt->pyrlevel = 0;
+    opt->pyrwin = 0;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Align image stream in real-time, with options\n
+ * 
+ * ## Arguments
+ * 
+ * Same as AOloopControl_IOtools_imAlignStream(), and :
+ * 
+ * @param[in]
+ * opt		IMALIGN_OPTIONS*
+ * 			Alignment options, see AOloopControl_IOtools_imAlignStream_defaultoptions()
+ * 
+ * 
+ * ## Details
+ * 
+ * opt->peakmode selects the correlation peak subpixel estimator :\n
+ * IMALIGN_PEAK_GAUSSCENTROID : 3 iterations of Gaussian-weighted centroid over full box\n
+ * IMALIGN_PEAK_PARABOLIC     : separable 3-point parabolic fit\n
+ * IMALIGN_PEAK_QUADFIT3      : 2D quadratic fit, 3x3 neighborhood\n
+ * IMALIGN_PEAK_QUADFIT5      : 2D quadratic fit, 5x5 neighborhood\n
+ * IMALIGN_PEAK_CENTROID      : centroid of 5x5 neighborhood\n
+ * All but IMALIGN_PEAK_GAUSSCENTROID only read the neighborhood of the integer peak.
+ * 
+ * Shift-and-add : if opt->SAname is not empty, aligned frames are averaged into stream
+ * opt->SAname, updated in place (running mean) from the output frame while it is in cache.
+ * The average restarts every opt->SANBframe kept frames (never if 0).\n
+ * Frame selection (opt->selmode) :\n
+ * IMALIGN_SEL_NONE     : all frames are kept\n
+ * IMALIGN_SEL_CORRPEAK : quality is correlation peak value\n
+ * IMALIGN_SEL_STREHL   : quality is max/sum of aligned frame over alignment box\n
+ * Approximately fraction opt->selfrac of frames, those with highest quality, are kept.\n
+ * If opt->qualname is not empty, per-frame values are written to that 1D stream :
+ * xoffset, yoffset, correlation peak, quality, kept flag.
+ * 
+ * Output mode (opt->outmode) :\n
+ * IMALIGN_OUT_IMAGE   : IDout_name is the translated (aligned) frame\n
+ * IMALIGN_OUT_OFFSETS : frames are not translated, only the alignment box is read from input.
+ * IDout_name is a 4-element DOUBLE stream : xoffset, yoffset, correlation peak, input cnt0,
+ * with cnt1 = input cnt0. xoffset and yoffset are the translation that aligns the frame
+ * to the reference. This turns the function into an image-based tip/tilt sensor.
+ * Shift-and-add and Strehl selection need translated frames and are not available in this mode.
+ * 
+ * Pyramid registration (opt->pyrlevel > 0) : the alignment box, binned by 2^opt->pyrlevel,
+ * is correlated with the binned reference to measure the coarse shift. An opt->pyrwin x opt->pyrwin
+ * full resolution window of the box, offset by the coarse shift, is then correlated with the central
+ * window of the reference to measure the residual shift (0 : automatic window size).
+ * The box size must be a multiple of 2^opt->pyrlevel. Shifts are measured over the full box
+ * at a fraction of the FFT cost, which allows large boxes at high frame rate.
+ * 
+ * \ingroup RTfunctions
+ */
+
+int_fast8_t AOloopControl_IOtools_imAlignStream_opt(
+    const char            *IDname,
+    int                    xbox0,
+    int                    ybox0,
+    const char            *IDref_name,
+    const char            *IDout_name,
+    int                    insem,
+    const IMALIGN_OPTIONS *opt
+)
+{
+    long IDin, IDref;
+    uint32_t xboxsize, yboxsize;
+    uint32_t xsize, ysize;
+    long nelem;
+    uint64_t cnt = 0;
+    uint64_t refcnt;
+    IMALIGN_ENGINE eng;
+
+    long IDdark;
+
+    float xoffset, yoffset;
+
+    IDin = image_ID(IDname);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    nelem = xsize*ysize;
+
+    IDref = image_ID(IDref_name);
+    xboxsize = data.image[IDref].md[0].size[0];
+    yboxsize = data.image[IDref].md[0].size[1];
+
+    if((xbox0 < 0)||(ybox0 < 0)||(xbox0+xboxsize > xsize)||(ybox0+yboxsize > ysize))
+    {
+        printf("ERROR: alignment box outside of input image\n");
+        exit(0);
+    }
+    if((datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)||(datastream_datatype_supported(data.image[IDref].md[0].datatype) == 0))
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+
+    // is there a dark ?
+    IDdark = image_ID("dark");
+    if((IDdark != -1)&&((data.image[IDdark].md[0].datatype != _DATATYPE_FLOAT)||(data.image[IDdark].md[0].size[0] != xsize)||(data.image[IDdark].md[0].size[1] != ysize)))
+    {
+        printf("ERROR: dark has wrong size or type\n");
+        exit(0);
+    }
+
+
+    if((opt->outmode == IMALIGN_OUT_OFFSETS)&&((opt->SAname[0] != '\0')||(opt->selmode == IMALIGN_SEL_STREHL)))
+    {
+        printf("ERROR: shift-and-add and Strehl selection require translated frames\n");
+        exit(0);
+    }
+
+    if((opt->pyrlevel < 0)||(opt->pyrlevel > IMALIGN_MAXPYRLEVEL))
+    {
+        printf("ERROR: pyramid level %d outside of range [0,%d]\n", opt->pyrlevel, IMALIGN_MAXPYRLEVEL);
+        exit(0);
+    }
+
+
+	// create output stream
+	long IDout;
+	uint32_t *sizearray;
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+    if(opt->outmode == IMALIGN_OUT_OFFSETS)
+    {
+        sizearray[0] = 4;
+        sizearray[1] = 1;
+        IDout = create_image_ID(IDout_name, 2, sizearray, _DATATYPE_DOUBLE, 1, 0);
+    }
+    else
+    {
+        sizearray[0] = xsize;
+        sizearray[1] = ysize;
+        IDout = create_image_ID(IDout_name, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+    }
+    COREMOD_MEMORY_image_set_createsem(IDout_name, 10);
+    free(sizearray);
+
+
+    // shift-and-add and quality streams
+    long IDsa = -1;
+    long IDqual = -1;
+    long SAcnt = 0;
+    IMALIGN_SELECT sel;
+
+    sel.cnt = 0;
+    if(opt->SAname[0] != '\0')
+    {
+        sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+        sizearray[0] = xsize;
+        sizearray[1] = ysize;
+        IDsa = create_image_ID(opt->SAname, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+        COREMOD_MEMORY_image_set_createsem(opt->SAname, 10);
+        free(sizearray);
+    }
+    if(opt->qualname[0] != '\0')
+    {
+        sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
+        sizearray[0] = 5;
+        sizearray[1] = 1;
+        IDqual = create_image_ID(opt->qualname, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
+        COREMOD_MEMORY_image_set_createsem(opt->qualname, 10);
+        free(sizearray);
+    }
+
+
+    if(opt->outmode == IMALIGN_OUT_OFFSETS)
+        imalign_engine_init(&eng, xsize, ysize, xboxsize, yboxsize, xbox0, ybox0, opt->pyrlevel, opt->pyrwin, NULL);
+    else
+        imalign_engine_init(&eng, xsize, ysize, xboxsize, yboxsize, xbox0, ybox0, opt->pyrlevel, opt->pyrwin, data.image[IDout].array.F);
+    imalign_engine_setref(&eng, IDref);
+    refcnt = data.image[IDref].md[0].cnt0;
+
+
+    for(;;)
+    {
+        if(data.image[IDin].md[0].sem==0)
+        {
+            while(cnt==data.image[IDin].md[0].cnt0) // test if new frame exists
+                usleep(5);
+            cnt = data.image[IDin].md[0].cnt0;
+        }
+        else
+            sem_wait(data.image[IDin].semptr[insem]);
+
+
+        // dark-subtracted full frame image, or alignment box only
+        if(eng.fullframe == 1)
+        {
+            datastream_read_float(&data.image[IDin], 0, nelem, eng.fullin);
+            if(IDdark != -1)
+            {
+                long ii;
+                for(ii=0; ii<nelem; ii++)
+                    eng.fullin[ii] -= data.image[IDdark].array.F[ii];
+            }
+            imalign_engine_extractbox(&eng);
+        }
+        else
+            imalign_engine_readbox(&eng, IDin, IDdark);
+
+        // reference updated ?
+        if(data.image[IDref].md[0].cnt0 != refcnt)
+        {
+            imalign_engine_setref(&eng, IDref);
+            refcnt = data.image[IDref].md[0].cnt0;
+        }
+
+
+        // compute cross correlation and find the correlation peak
+        float corrpeak;
+        corrpeak = imalign_engine_measure(&eng, opt->peakmode, &xoffset, &yoffset);
+
+        xoffset = -xoffset;
+        yoffset = -yoffset;
+
+       // printf("offset = %4.2f %4.2f\n", xoffset, yoffset);
+       // fflush(stdout);
+
+        // write to IDout
+        data.image[IDout].md[0].write = 1;
+        if(opt->outmode == IMALIGN_OUT_OFFSETS)
+        {
+            data.image[IDout].array.D[0] = xoffset;
+            data.image[IDout].array.D[1] = yoffset;
+            data.image[IDout].array.D[2] = corrpeak;
+            data.image[IDout].array.D[3] = 1.0*data.image[IDin].md[0].cnt0;
+            data.image[IDout].md[0].cnt1 = data.image[IDin].md[0].cnt0;
+        }
+        else
+            imalign_engine_translate(&eng, xoffset, yoffset);
+        data.image[IDout].md[0].cnt0++;
+        data.image[IDout].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+
+
+        // frame selection and shift-and-add
+        if((IDsa != -1)||(IDqual != -1))
+        {
+            float quality = corrpeak;
+            int keep = 1;
+
+            if(opt->selmode == IMALIGN_SEL_STREHL)
+                quality = imalign_strehlproxy(&eng, data.image[IDout].array.F);
+            if(opt->selmode != IMALIGN_SEL_NONE)
+                keep = imalign_select(&sel, quality, opt->selfrac);
+
+            if((IDsa != -1)&&(keep == 1))
+            {
+                float *restrict sa = data.image[IDsa].array.F;
+                const float *restrict frame = data.image[IDout].array.F;
+                float coeff;
+                long ii;
+
+                if((opt->SANBframe > 0)&&(SAcnt == opt->SANBframe))
+                    SAcnt = 0;
+                SAcnt++;
+                coeff = 1.0/SAcnt;
+
+                data.image[IDsa].md[0].write = 1;
+                for(ii=0; ii<nelem; ii++)
+                    sa[ii] += coeff*(frame[ii] - sa[ii]);
+                data.image[IDsa].md[0].cnt1 = SAcnt;
+                data.image[IDsa].md[0].cnt0++;
+                data.image[IDsa].md[0].write = 0;
+                COREMOD_MEMORY_image_set_sempost_byID(IDsa, -1);
+            }
+
+            if(IDqual != -1)
+            {
+                data.image[IDqual].md[0].write = 1;
+                data.image[IDqual].array.F[0] = xoffset;
+                data.image[IDqual].array.F[1] = yoffset;
+                data.image[IDqual].array.F[2] = corrpeak;
+                data.image[IDqual].array.F[3] = quality;
+                data.image[IDqual].array.F[4] = 1.0*keep;
+                data.image[IDqual].md[0].cnt1 = data.image[IDin].md[0].cnt0;
+                data.image[IDqual].md[0].cnt0++;
+                data.image[IDqual].md[0].write = 0;
+                COREMOD_MEMORY_image_set_sempost_byID(IDqual, -1);
+            }
+        }
+    }
+
+    imalign_engine_free(&eng);
+
+    return 0;
+}
+
+
+
+
+
+
+
+/** @brief Packed list of non-zero frameDelay kernel taps (see framedelay_kernel_compile()) */
+typedef struct
+{
+    long          NBalloc;  // allocated number of taps
+    long          NBtap;    // number of non-zero taps
+    long          lagmax;   // largest tap delay [frame], 0 if no tap
+    long         *lag;      // tap delay [frame]
+    float        *coeff;    // tap coefficient
+    const float **frame;    // history frame of each tap, set by framedelay_kernel_apply()
+} FRAMEDELAY_KERNEL;
+
+
+
+
+/** @brief Allocate packed kernel for up to ksize taps */
+static void framedelay_kernel_alloc(
+    FRAMEDELAY_KERNEL *kern,
+    long               ksize
+)
+{
+    kern->NBalloc = ksize;
+    kern->NBtap = 0;
+    kern->lagmax = 0;
+    kern->lag   = (long*) malloc(sizeof(long)*ksize);
+    kern->coeff = (float*) malloc(sizeof(float)*ksize);
+    kern->frame = (const float**) malloc(sizeof(const float*)*ksize);
+    if((kern->lag == NULL)||(kern->coeff == NULL)||(kern->frame == NULL))
+    {
+        printf("ERROR: cannot allocate kernel\n");
+        exit(0);
+    }
+}
+
+
+
+
+/** @brief Free packed kernel */
+static void framedelay_kernel_free(
+    FRAMEDELAY_KERNEL *kern
+)
+{
+    free(kern->lag);
+    free(kern->coeff);
+    free(kern->frame);
+}
+
+
+
+
+/** @brief Pack taps of kernel stream IDkern with absolute value above eps
+ *
+ * Returns 0 if the kernel stream was not written during the copy, 1 otherwise,
+ * in which case kern content must not be used.\n
+ * Kernel stream cnt0 at compile time is written in *cnt0p.
+ */
+static int framedelay_kernel_compile(
+    FRAMEDELAY_KERNEL *kern,
+    long               IDkern,
+    float              eps,
+    uint64_t          *cnt0p
+)
+{
+    long ksize = data.image[IDkern].md[0].size[0];
+    const float *kernarray = data.image[IDkern].array.F;
+    uint64_t cnt0;
+    long kk;
+
+    cnt0 = data.image[IDkern].md[0].cnt0;
+    *cnt0p = cnt0;
+    if(data.image[IDkern].md[0].write == 1)
+        return 1;
+
+    kern->NBtap = 0;
+    kern->lagmax = 0;
+    for(kk=0; kk<ksize; kk++)
+        if(fabs(kernarray[kk]) > eps)
+        {
+            kern->lag[kern->NBtap] = kk;
+            kern->coeff[kern->NBtap] = kernarray[kk];
+            kern->NBtap++;
+            kern->lagmax = kk;
+        }
+
+    if((data.image[IDkern].md[0].write == 1)||(data.image[IDkern].md[0].cnt0 != cnt0))
+        return 1;
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Resize frame history ring, keeping most recent frames
+ *
+ * Ring *buffp holds *hsizep frames of xysize elements, latest frame at index *kindexp.\n
+ * After resizing to hsize frames, the latest frame is at index *kindexp, older frames
+ * at decreasing indices (modulo hsize). Frames older than the previous ring are zero.
+ */
+static void framedelay_history_resize(
+    float **buffp,
+    long   *hsizep,
+    long   *kindexp,
+    long    xysize,
+    long    hsize
+)
+{
+    float *buff;
+    long nkeep;
+    long j;
+
+    buff = (float*) calloc(hsize*xysize, sizeof(float));
+    if(buff == NULL)
+    {
+        printf("ERROR: cannot allocate frame history\n");
+        exit(0);
+    }
+
+    nkeep = (*hsizep < hsize) ? *hsizep : hsize;
+    for(j=0; j<nkeep; j++)
+    {
+        long k0 = *kindexp - j;
+        if(k0 < 0)
+            k0 += *hsizep;
+        memcpy(buff + (nkeep-1-j)*xysize, *buffp + k0*xysize, sizeof(float)*xysize);
+    }
+
+    free(*buffp);
+    *buffp = buff;
+    *hsizep = hsize;
+    *kindexp = nkeep-1;
+}
+
+
+
+
+/**
+ * @brief Apply packed kernel to frame history, writing into dst
+ *
+ * History buff holds ksize frames of xysize elements, latest frame at index kindex.\n
+ * Pixels are processed in blocks of DATASTREAM_BLOCKSIZE, all taps per block,
+ * so that the output block stays in cache. Blocks are distributed over threads
+ * when the number of multiply-adds is large.
+ */
+static void framedelay_kernel_apply(
+    FRAMEDELAY_KERNEL *kern,
+    const float       *buff,
+    long               ksize,
+    long               kindex,
+    long               xysize,
+    float             *dst
+)
+{
+    long NBtap = kern->NBtap;
+    long tap;
+    long blk;
+
+    if(NBtap == 0)
+    {
+        memset(dst, 0, sizeof(float)*xysize);
+        return;
+    }
+
+    for(tap=0; tap<NBtap; tap++)
+    {
+        long k1 = kindex - kern->lag[tap];
+        if(k1 < 0)
+            k1 += ksize;
+        kern->frame[tap] = buff + k1*xysize;
+    }
+
+    // pure delay
+    if((NBtap == 1)&&(kern->coeff[0] == 1.0f))
+    {
+        memcpy(dst, kern->frame[0], sizeof(float)*xysize);
+        return;
+    }
+
+# ifdef _OPENMP
+    #pragma omp parallel for if (xysize*NBtap>OMP_NELEMENT_LIMIT)
+# endif
+    for(blk=0; blk<xysize; blk+=DATASTREAM_BLOCKSIZE)
+    {
+        float *restrict out = dst + blk;
+        long n = xysize-blk;
+        long t, ii;
+
+        if(n > DATASTREAM_BLOCKSIZE)
+            n = DATASTREAM_BLOCKSIZE;
+
+        {
+            const float *restrict in = kern->frame[0] + blk;
+            float c = kern->coeff[0];
+
+            for(ii=0; ii<n; ii++)
+                out[ii] = c*in[ii];
+        }
+        for(t=1; t<NBtap; t++)
+        {
+            const float *restrict in = kern->frame[t] + blk;
+            float c = kern->coeff[t];
+
+            for(ii=0; ii<n; ii++)
+                out[ii] += c*in[ii];
+        }
+    }
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Apply temporal FIR kernel to data stream\n
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDin_name	char*
+ * 				Input stream name, any real datatype
+ * 
+ * @param[in]
+ * IDkern_name	char*
+ * 				Temporal kernel (FLOAT). Element k is the coefficient applied to the frame k frames old.
+ * 
+ * @param[out]
+ * IDout_name	char*
+ * 				Output stream name (FLOAT)
+ * 
+ * @param[in]
+ * insem		int
+ * 				Input semaphore index
+ * 
+ * ## Details
+ * 
+ * Kernel taps with absolute value above eps are packed into a list (lag, coefficient),
+ * and the output is accumulated tap by tap directly into the output stream, in pixel blocks.\n
+ * Input frames are written into a history ring of ksize frames (kernel stream size), so that
+ * any kernel within ksize applies to real history as soon as it is swapped in.\n
+ * Hot-swap : when the kernel stream cnt0 changes, the kernel is packed into the inactive
+ * kernel buffer between frames. If the copy is consistent (kernel not written meanwhile),
+ * kernels are swapped before the next frame.\n
+ * If the kernel stream is recreated (generation counter cnt2 or size changed), the stale local
+ * entry is deleted and the stream is reconnected by name (retried every FRAMEDELAY_RECONNECT_NS
+ * while absent, the current kernel stays active meanwhile), and the history ring is resized to the new ksize when the new kernel is swapped in,
+ * keeping the most recent frames.\n
+ * A kernel with a single unit tap is a pure delay : the delayed frame is copied with a single memcpy.
+ * See also AOloopControl_IOtools_frameDelayRing(), which avoids the copy.
+ * 
+ * \ingroup RTfunctions
+ */
+long AOloopControl_IOtools_frameDelay(
+	const char *IDin_name, 
+	const char *IDkern_name, 
+	const char *IDout_name, 
+	int insem
+	)
+{
+    long IDout;
+    long IDin;
+    long IDkern;
+    long ksize;
+    long xsize, ysize;
+    long kindex;
+    uint64_t cnt = 0;
+    uint64_t kerncnt0;
+    uint64_t kerngen;    // kernel stream generation (cnt2)
+    int kernnew = 0;     // 1 if kernel stream was recreated, kernel not yet swapped in
+    int kernshared;      // 1 if kernel is a shared memory stream
+    struct timespec tkernretry = {0, 0}; // next reconnect attempt while kernel stream is absent
+    long xysize;
+    float eps=1.0e-8;
+    uint32_t *sizearray;
+    int semindex;
+    FRAMEDELAY_KERNEL kern[2];
+    int kernindex = 0;   // active kernel
+    float *buff;         // frame history ring
+    long hsize;          // number of frames in history ring
+
+
+
+    IDin = image_ID(IDin_name);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    xysize = xsize*ysize;
+
+    printf("xsize = %ld\n", xsize);
+    printf("ysize = %ld\n", ysize);
+    fflush(stdout);
 
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
 
 
 
     IDkern = image_ID(IDkern_name);
+    if(data.image[IDkern].md[0].datatype != _DATATYPE_FLOAT)
+    {
+        printf("ERROR: kernel must be FLOAT\n");
+        exit(0);
+    }
     ksize = data.image[IDkern].md[0].size[0];
     printf("ksize = %ld\n", ksize);
     fflush(stdout);
 
+    framedelay_kernel_alloc(&kern[0], ksize);
+    framedelay_kernel_alloc(&kern[1], ksize);
+    while(framedelay_kernel_compile(&kern[kernindex], IDkern, eps, &kerncnt0) != 0)
+        usleep(100);
+    kerngen = data.image[IDkern].md[0].cnt2;
+    kernshared = data.image[IDkern].md[0].shared;
+
 
-    IDbuff = create_3Dimage_ID("_tmpbuff", xsize, ysize, ksize);
+    hsize = ksize;
+    buff = (float*) calloc(hsize*xysize, sizeof(float));
+    if(buff == NULL)
+    {
+        printf("ERROR: cannot allocate frame history\n");
+        exit(0);
+    }
 
     sizearray = (uint32_t*) malloc(sizeof(uint32_t)*2);
     sizearray[0] = xsize;
@@ -524,95 +3321,368 @@ long AOloopControl_IOtools_frameDelay(
     free(sizearray);
 
 
-    framesize = sizeof(float)*xsize*ysize;
-
-
-    kindex = 0;
-    cnt = 0;
+    kindex = hsize-1;
+    semindex = datastream_init_semwait(IDin, insem);
 
     for(;;)
     {
-        if(data.image[IDin].md[0].sem==0)
-        {
-            while(cnt==data.image[IDin].md[0].cnt0) // test if new frame exists
-                usleep(5);
-            cnt = data.image[IDin].md[0].cnt0;
-        }
-        else
-            sem_wait(data.image[IDin].semptr[insem]);
+        datastream_wait_frame(IDin, semindex, &cnt);
 
-        char *ptr0;
-
-        ptr0 = (char*) data.image[IDbuff].array.F;
-        ptr0 += kindex*framesize;
+        kindex++;
+        if(kindex == hsize)
+            kindex = 0;
+        datastream_read_float(&data.image[IDin], 0, xysize, buff + kindex*xysize);
 
-        data.image[IDbuff].md[0].write = 1;
-        memcpy((void*) ptr0, data.image[IDin].array.F, framesize);
-        data.image[IDbuff].md[0].cnt0++;
-        data.image[IDbuff].md[0].write = 0;
+        data.image[IDout].md[0].write = 1;
+        framedelay_kernel_apply(&kern[kernindex], buff, hsize, kindex, xysize, data.image[IDout].array.F);
+        data.image[IDout].md[0].cnt0++;
+        data.image[IDout].md[0].write = 0;
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
 
 
-        data.image[IDout].md[0].write = 1;
+        // kernel stream recreated : drop stale entry, reconnect immediately
+        if((IDkern != -1)&&((data.image[IDkern].md[0].cnt2 != kerngen)||(data.image[IDkern].md[0].size[0] != ksize)))
+        {
+            if(kernshared == 1)
+                delete_image_ID(IDkern_name);
+            IDkern = -1;
+            tkernretry.tv_sec = 0;
+            tkernretry.tv_nsec = 0;
+        }
 
-        for(ii=0; ii<xysize; ii++)
-            data.image[IDtmp].array.F[ii] = 0.0;
-        for(kk=0; kk<ksize; kk++)
+        // reconnect by name, retried every FRAMEDELAY_RECONNECT_NS while kernel stream is absent
+        if(IDkern == -1)
         {
-            if(fabs(data.image[IDkern].array.F[kk])>eps)
+            struct timespec tnow;
+
+            clock_gettime(CLOCK_MONOTONIC, &tnow);
+            if((tnow.tv_sec > tkernretry.tv_sec)||((tnow.tv_sec == tkernretry.tv_sec)&&(tnow.tv_nsec >= tkernretry.tv_nsec)))
             {
-                k1 = kindex-kk;
-                if(k1<0)
-                    k1 += ksize;
+                if(kernshared == 1)
+                    IDkern = read_sharedmem_image(IDkern_name);
+                else
+                    IDkern = image_ID(IDkern_name);
 
-                for(ii=0; ii<xysize; ii++)
-                    data.image[IDtmp].array.F[ii] += data.image[IDkern].array.F[kk] * data.image[IDbuff].array.F[k1*xysize + ii];
+                if((IDkern != -1)&&(data.image[IDkern].md[0].datatype != _DATATYPE_FLOAT))
+                {
+                    if(kernshared == 1)
+                        delete_image_ID(IDkern_name);
+                    IDkern = -1;
+                }
+                if(IDkern != -1)
+                {
+                    ksize = data.image[IDkern].md[0].size[0];
+                    kerngen = data.image[IDkern].md[0].cnt2;
+                    kernnew = 1;
+                }
+                else
+                {
+                    tkernretry = tnow;
+                    tkernretry.tv_nsec += FRAMEDELAY_RECONNECT_NS;
+                    while(tkernretry.tv_nsec >= 1000000000)
+                    {
+                        tkernretry.tv_nsec -= 1000000000;
+                        tkernretry.tv_sec++;
+                    }
+                }
             }
         }
-        memcpy(data.image[IDout].array.F, data.image[IDtmp].array.F, framesize);
-        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+
+        // kernel hot-swap, between frames
+        if((IDkern != -1)&&((data.image[IDkern].md[0].cnt0 != kerncnt0)||(kernnew == 1)))
+        {
+            uint64_t newcnt0;
+
+            if(kern[1-kernindex].NBalloc < ksize)
+            {
+                framedelay_kernel_free(&kern[1-kernindex]);
+                framedelay_kernel_alloc(&kern[1-kernindex], ksize);
+            }
+            if(framedelay_kernel_compile(&kern[1-kernindex], IDkern, eps, &newcnt0) == 0)
+            {
+                kernindex = 1-kernindex;
+                kerncnt0 = newcnt0;
+                kernnew = 0;
+                if(hsize != ksize)
+                    framedelay_history_resize(&buff, &hsize, &kindex, xysize, ksize);
+            }
+        }
+    }
+
+    framedelay_kernel_free(&kern[0]);
+    framedelay_kernel_free(&kern[1]);
+    free(buff);
+
+    return IDout;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Pure delay of data stream, zero-copy output\n
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDin_name	char*
+ * 				Input stream name, any real datatype
+ * 
+ * @param[out]
+ * IDout_name	char*
+ * 				Output 3D ring stream name (FLOAT), delay+2 slices
+ * 
+ * @param[in]
+ * delay		long
+ * 				Delay [frame]
+ * 
+ * @param[in]
+ * insem		int
+ * 				Input semaphore index
+ * 
+ * ## Details
+ * 
+ * Each input frame is written once, into the next slice of the output ring.\n
+ * The output cnt1 is then set to the index of the slice holding the frame delay frames old,
+ * and cnt0 is incremented: readers use slice cnt1 of the output stream. The published slice is
+ * overwritten two frames later, giving readers a full frame period to consume it.\n
+ * Slices are zero until delay frames have been received.
+ * 
+ * \ingroup RTfunctions
+ */
+long AOloopControl_IOtools_frameDelayRing(
+	const char *IDin_name, 
+	const char *IDout_name, 
+	long delay,
+	int insem
+	)
+{
+    long IDout;
+    long IDin;
+    long xsize, ysize;
+    long xysize;
+    long NBslice;
+    long kindex = 0;
+    uint64_t cnt = 0;
+    uint32_t *sizearray;
+    int semindex;
+
+
+    IDin = image_ID(IDin_name);
+    xsize = data.image[IDin].md[0].size[0];
+    ysize = data.image[IDin].md[0].size[1];
+    xysize = xsize*ysize;
+
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+    if(delay < 0)
+    {
+        printf("ERROR: delay must be >= 0\n");
+        exit(0);
+    }
+
+    NBslice = delay+2;
+    printf("delay = %ld frame(s), %ld slices\n", delay, NBslice);
+    fflush(stdout);
+
+    sizearray = (uint32_t*) malloc(sizeof(uint32_t)*3);
+    sizearray[0] = xsize;
+    sizearray[1] = ysize;
+    sizearray[2] = NBslice;
+    IDout = create_image_ID(IDout_name, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
+    COREMOD_MEMORY_image_set_createsem(IDout_name, 10);
+    free(sizearray);
+
+
+    semindex = datastream_init_semwait(IDin, insem);
+
+    for(;;)
+    {
+        long k1;
+
+        datastream_wait_frame(IDin, semindex, &cnt);
+
+        k1 = kindex - delay;
+        if(k1 < 0)
+            k1 += NBslice;
+
+        data.image[IDout].md[0].write = 1;
+        datastream_read_float(&data.image[IDin], 0, xysize, data.image[IDout].array.F + kindex*xysize);
+        data.image[IDout].md[0].cnt1 = k1;
         data.image[IDout].md[0].cnt0++;
         data.image[IDout].md[0].write = 0;
-
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
 
         kindex++;
-        if(kindex == ksize)
+        if(kindex == NBslice)
             kindex = 0;
     }
 
-
     return IDout;
 }
 
 
 
 
-long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_name, int NBcols, int insem)
+
+/**
+ * @brief Philox4x32-10 counter-based random number generator
+ *
+ * Replaces the 4-word counter ctr with 4 random 32-bit words, for key (key0, key1).\n
+ * Output depends only on counter and key : streams are reproducible and can be
+ * generated in any order, by any number of threads.
+ */
+static inline void philox4x32(
+    uint32_t ctr[4],
+    uint32_t key0,
+    uint32_t key1
+)
 {
-    long IDin, IDout;
-    uint_fast16_t xsize0, ysize0, zsize0;
-    uint_fast32_t xysize0;
-    uint_fast16_t xsize1, ysize1;
-    uint_fast16_t ii0, jj0, kk0, ii1, jj1, kk;
-    uint_fast16_t Xindex, Yindex;
-    uint_fast16_t iioffset, jjoffset;
-    long long cnt;
-    uint32_t *sizearray;
-    uint8_t datatype;
-    char out0name[200]; // noise-free image, in contrast
-    long IDout0;
+    int r;
+
+    for(r=0; r<10; r++)
+    {
+        uint64_t p0 = (uint64_t) 0xD2511F53 * ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57 * ctr[2];
+        uint32_t c1 = (uint32_t) p1;
+        uint32_t c3 = (uint32_t) p0;
+
+        ctr[0] = (uint32_t) (p1 >> 32) ^ ctr[1] ^ key0;
+        ctr[2] = (uint32_t) (p0 >> 32) ^ ctr[3] ^ key1;
+        ctr[1] = c1;
+        ctr[3] = c3;
+        key0 += 0x9E3779B9;
+        key1 += 0xBB67AE85;
+    }
+}
+
+
+/** @brief Uniform deviate in ]0,1[ from random 32-bit word */
+static inline float philox_uniform(uint32_t x)
+{
+    return ((x >> 8) + 0.5f) * (1.0f/16777216.0f);
+}
+
+
+/**
+ * @brief Poisson deviate of mean lambda from 4 random 32-bit words
+ *
+ * Exact (inversion) below STREAM3DTO2D_POISSON_NORMALTHRESH, normal approximation
+ * (Box-Muller, rounded, clipped at 0) above.
+ */
+static inline float philox_poisson(
+    float          lambda,
+    const uint32_t rnd[4]
+)
+{
+    if(lambda <= 0.0f)
+        return 0.0f;
+
+    if(lambda < STREAM3DTO2D_POISSON_NORMALTHRESH)
+    {
+        double u = philox_uniform(rnd[0]);
+        double p = exp(-lambda);
+        double F = p;
+        int k = 0;
 
-    float ContrastCoeff = 0.0379;
-    float Flux = 5.22e8; // flux per spectral channel [NBph]
-    // spectral channel 1% broad = 0.00638 um
-    // mR = 5
-    // 6m radius disk (12m diam)
+        while((u > F)&&(k < 1000))
+        {
+            k++;
+            p *= lambda/k;
+            F += p;
+        }
+        return 1.0f*k;
+    }
+    else
+    {
+        float z = sqrtf(-2.0f*logf(philox_uniform(rnd[1]))) * cosf(2.0f*M_PI*philox_uniform(rnd[2]));
+        float k = floorf(lambda + sqrtf(lambda)*z + 0.5f);
 
+        return (k > 0.0f) ? k : 0.0f;
+    }
+}
 
 
 
 
-    Flux *= 0.4; // efficiency
-    Flux *= 3600.0; // second -> hr
+/**
+ * ## Purpose
+ * 
+ * Re-arrange 3D cube stream into a 2D mosaic of its slices\n
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * in_name		char*
+ * 				Input 3D stream name, any real datatype
+ * 
+ * @param[out]
+ * out_name		char*
+ * 				Output mosaic with photon noise (FLOAT). A noise-free mosaic is also written to <out_name>c
+ * 
+ * @param[in]
+ * NBcols		int
+ * 				Number of tile columns in mosaic
+ * 
+ * @param[in]
+ * insem		int
+ * 				Input semaphore index
+ * 
+ * @param[in]
+ * Flux			float
+ * 				Number of photons per unit input value, 0 for no photon noise
+ * 
+ * @param[in]
+ * ContrastCoeff	float
+ * 				Mosaic values are input values divided by ContrastCoeff
+ * 
+ * @param[in]
+ * seed			long
+ * 				Photon noise random generator seed
+ * 
+ * ## Details
+ * 
+ * Slice kk is placed at tile column kk%NBcols, tile row kk/NBcols. Tile offsets are
+ * computed once. Each input row is converted with one contiguous loop into the noise-free
+ * mosaic, and slices are distributed over threads.\n
+ * Photon noise : each mosaic pixel is a Poisson deviate of mean Flux x input value,
+ * divided by Flux x ContrastCoeff. Random numbers come from a counter-based generator
+ * (Philox4x32-10) keyed by seed, with counter (pixel index, frame index), so noise
+ * is reproducible for a given seed and independent of the number of threads.
+ * 
+ * \ingroup RTfunctions
+ */
+long AOloopControl_IOtools_stream3Dto2D(
+    const char *in_name,
+    const char *out_name,
+    int         NBcols,
+    int         insem,
+    float       Flux,
+    float       ContrastCoeff,
+    long        seed
+)
+{
+    long IDin, IDout;
+    long xsize0, ysize0, zsize0;
+    long xysize0;
+    long xsize1, ysize1;
+    long xysize1;
+    long kk0;
+    long *tileoffset;  // mosaic offset of first pixel of each slice
+    uint64_t cnt = 0;
+    int semindex;
+    uint32_t *sizearray;
+    uint8_t datatype;
+    char out0name[200]; // noise-free image, in contrast
+    long IDout0;
+    uint64_t framecnt = 0;
+    uint32_t key0 = (uint32_t) seed;
+    uint32_t key1 = (uint32_t) ((uint64_t) seed >> 32);
 
 
 
@@ -622,8 +3692,24 @@ long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_nam
     zsize0 = data.image[IDin].md[0].size[2];
     xysize0 = xsize0*ysize0;
 
+    if(datastream_datatype_supported(data.image[IDin].md[0].datatype) == 0)
+    {
+        printf("ERROR: DATA TYPE NOT SUPPORTED\n");
+        exit(0);
+    }
+
     xsize1 = xsize0*NBcols;
-    ysize1 = ysize0*(1 + (long) (1.0*zsize0/NBcols-0.00001));
+    ysize1 = ysize0*((zsize0 + NBcols - 1)/NBcols);
+    xysize1 = xsize1*ysize1;
+
+    tileoffset = (long*) malloc(sizeof(long)*zsize0);
+    if(tileoffset == NULL)
+    {
+        printf("ERROR: cannot allocate tile map\n");
+        exit(0);
+    }
+    for(kk0=0; kk0<zsize0; kk0++)
+        tileoffset[kk0] = (kk0/NBcols)*ysize0*xsize1 + (kk0%NBcols)*xsize0;
 
     if(sprintf(out0name, "%sc", out_name) < 1)
         printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
@@ -636,59 +3722,79 @@ long AOloopControl_IOtools_stream3Dto2D(const char *in_name, const char *out_nam
     IDout0 = create_image_ID(out0name, 2, sizearray, datatype, 1, 0);
     free(sizearray);
 
+    semindex = datastream_init_semwait(IDin, insem);
+
     for(;;)
     {
-        if(data.image[IDin].md[0].sem==0)
-        {
-            while(cnt==data.image[IDin].md[0].cnt0) // test if new frame exists
-                usleep(5);
-            cnt = data.image[IDin].md[0].cnt0;
-        }
-        else
-            sem_wait(data.image[IDin].semptr[insem]);
-
+        float *out = data.image[IDout].array.F;
+        float *out0 = data.image[IDout0].array.F;
+        float invcontrast = 1.0/ContrastCoeff;
+        long blk;
 
-        printf("Updating image %s ...", out_name);
-        fflush(stdout);
+        datastream_wait_frame(IDin, semindex, &cnt);
 
         data.image[IDout].md[0].write = 1;
+        data.image[IDout0].md[0].write = 1;
 
+        // noise-free mosaic
+# ifdef _OPENMP
+        #pragma omp parallel for if (zsize0*xysize0>OMP_NELEMENT_LIMIT)
+# endif
         for(kk0=0; kk0<zsize0; kk0++)
         {
-            kk = 0;
-            Xindex = 0;
-            Yindex = 0;
-            while(kk<kk0)
+            long jj0, ii0;
+
+            for(jj0=0; jj0<ysize0; jj0++)
             {
-                Xindex++;
-                if(Xindex==NBcols)
-                {
-                    Xindex = 0;
-                    Yindex++;
-                }
-                kk++;
+                float *restrict row = out0 + tileoffset[kk0] + jj0*xsize1;
+
+                datastream_read_float(&data.image[IDin], kk0*xysize0 + jj0*xsize0, xsize0, row);
+                for(ii0=0; ii0<xsize0; ii0++)
+                    row[ii0] *= invcontrast;
             }
-            iioffset = Xindex * xsize0;
-            jjoffset = Yindex * ysize0;
+        }
 
-            for(ii0=0; ii0<xsize0; ii0++)
-                for(jj0=0; jj0<ysize0; jj0++)
-                {
-                    ii1 = ii0+iioffset;
-                    jj1 = jj0+jjoffset;
-                    //data.image[IDout].array.F[jj1*xsize1+ii1] = data.image[IDin].array.F[kk0*xysize0+jj0*xsize0+ii0]/ContrastCoeff;
-                    data.image[IDout].array.F[jj1*xsize1+ii1] = poisson(data.image[IDin].array.F[kk0*xysize0+jj0*xsize0+ii0]*Flux)/Flux/ContrastCoeff;
+        // photon noise, over full mosaic (empty tiles are zero)
+        if(Flux > 0.0)
+        {
+            float lambdacoeff = ContrastCoeff*Flux;
+            float outcoeff = 1.0/(Flux*ContrastCoeff);
+
+# ifdef _OPENMP
+            #pragma omp parallel for if (xysize1>OMP_NELEMENT_LIMIT/10)
+# endif
+            for(blk=0; blk<xysize1; blk+=DATASTREAM_BLOCKSIZE)
+            {
+                long n = xysize1-blk;
+                long ii;
 
-                    data.image[IDout0].array.F[jj1*xsize1+ii1] = data.image[IDin].array.F[kk0*xysize0+jj0*xsize0+ii0]/ContrastCoeff;
+                if(n > DATASTREAM_BLOCKSIZE)
+                    n = DATASTREAM_BLOCKSIZE;
+                for(ii=blk; ii<blk+n; ii++)
+                {
+                    uint32_t rnd[4];
+
+                    rnd[0] = (uint32_t) ii;
+                    rnd[1] = (uint32_t) framecnt;
+                    rnd[2] = (uint32_t) (framecnt >> 32);
+                    rnd[3] = 0;
+                    philox4x32(rnd, key0, key1);
+                    out[ii] = philox_poisson(out0[ii]*lambdacoeff, rnd)*outcoeff;
                 }
+            }
         }
-        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
+        else
+            memcpy(out, out0, sizeof(float)*xysize1);
+        framecnt++;
+
+        data.image[IDout0].md[0].cnt0++;
+        data.image[IDout0].md[0].write = 0;
         data.image[IDout].md[0].cnt0++;
         data.image[IDout].md[0].write = 0;
-
-        printf("done\n");
-        fflush(stdout);
+        COREMOD_MEMORY_image_set_sempost_byID(IDout, -1);
     }
 
+    free(tileoffset);
+
     return(IDout);
 }
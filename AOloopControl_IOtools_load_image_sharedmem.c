@@ -26,6 +26,17 @@
 /* =============================================================================================== */
 
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "CommandLineInterface/CLIcore.h"
 #include "AOloopControl/AOloopControl.h"
@@ -46,6 +57,27 @@
 # endif
 
 
+// number of elements converted (and hashed) per chunk when loading FITS data into streams
+#define LOADSHM_CHUNKSIZE 262144
+
+// cnt1 of a 3D stream being loaded, before its first slice is loaded (cnt1+1 = number of slices loaded)
+#define LOADSHM_NOSLICE ((uint64_t) -1)
+
+// number of elements per slice group when streaming 3D FITS data into streams (progress published per group)
+#define LOADSHM_STREAMBLOCK 4194304
+
+// number of elements per block when converting FITS data to stream datatype
+#define LOADSHM_CONVBLOCK 4096
+
+// snapshot files: block alignment (O_DIRECT), chunk size [bytes], format identification
+#define LOADSHM_SNAP_ALIGN 4096
+#define LOADSHM_SNAP_CHUNKSIZE 4194304
+#define LOADSHM_SNAP_MAGIC "AOLSNAP\0"
+#define LOADSHM_SNAP_VERSION 1
+#define LOADSHM_SNAP_MAXTRY 10   // number of attempts to save a consistent snapshot of a stream being written
+#define LOADSHM_SNAP_WRITEWAIT 0.1   // maximum wait for write flag to clear, per attempt [s]
+
+
 /* =============================================================================================== */
 /* =============================================================================================== */
 /*                                  GLOBAL DATA DECLARATION                                        */
@@ -134,429 +166,2454 @@ extern AOloopControl_var aoloopcontrol_var; // declared in AOloopControl.c
 /* =============================================================================================== */
 
 
-/**
- * 
- * Implements stream loading policy with optional check on size for 2D images.
- * See CLIcore.h for policy details.
- * 
- * (1) If image already in local memory, and has correct size, upload FITS file to existing array, go to (END-success), otherwise, go to (2)
- * (2) If image already in local memory, but size does not match, go to (END-fail), otherwise, go to (3)
- * (3) Load FITS image to local memory
- * 
- * 
- */ 
+// loader verbosity, see AOloopControl_IOtools_loadcreate_setverbose()
+static int loadcreate_verbose = 1;
+
+// counter for temporary image names of files read with load_fits()
+static long loadcreate_tmpcnt = 0;
 
-long AOloopControl_IOtools_2Dloadcreate_shmim(
-    const char *name,     // stream name
-    const char *fname,    // file name
-    long xsize,           // X size
-    long ysize,           // Y size
-    float DefaultValue
-) {
-    long ID;
-    int CreateSMim = 0;
-    int sizeOK;
-    uint32_t *sizearray;
-    long ii;
 
-    int loadcreatestatus = -1;
-    // value of return code loadcreatestatus :
+/**
+ * @brief Memory-mapped FITS file, primary HDU (see loadcreate_fits_open())
+ *
+ * If the file cannot be mapped (compressed or non-standard FITS), it is read
+ * with load_fits() into image IDtmp, and map is NULL.
+ */
+typedef struct
+{
+    int                  fd;
+    unsigned char       *map;       // mapped file, NULL if read with load_fits()
+    size_t               maplen;
+    const unsigned char *data;      // start of primary data unit
+    long                 IDtmp;     // temporary image if read with load_fits(), -1 otherwise
+    char                 tmpname[32];   // name of temporary image, unique per file opened
+    int                  bitpix;
+    int                  bytepix;   // bytes per pixel
+    int                  naxis;
+    long                 naxes[3];
+    long                 nelem;
+    double               bzero;
+    double               bscale;
+    long                 fsize;     // file size [byte]
+    struct timespec      mtime;     // file modification time
+} LOADSHM_FITSMAP;
+
+
+/** @brief Load cache record, stored in sidecar file <shmdir>/<stream>.im.shm.loadcache */
+typedef struct
+{
+    char     fname[500];    // FITS file last loaded into stream
+    long     fsize;         // file size [byte]
+    long     mtime_sec;     // file modification time
+    long     mtime_nsec;
+    uint64_t hash;          // file content hash, 0 if unknown
+    uint64_t cnt0;          // stream cnt0 after load
+    uint64_t generation;    // stream generation (cnt2) at load
+    long     ctime_sec;     // stream creation time at load
+    long     ctime_nsec;
+} LOADSHM_CACHE;
+
+
+/** @brief Stream load/create task, see loadcreate_prepare() */
+typedef struct
+{
+    char            name[200];       // stream name
+    char            fname[500];      // FITS file name
+    int             naxis;           // 2 or 3
+    long            size[3];         // expected size, all 0 (3D) to create stream from FITS file
+    float           DefaultValue;    // value of created stream if FITS file is not loaded
+    uint8_t         datatype;        // stream datatype, FITS data is converted on load
+
+    long            ID;              // stream ID
+    int             CreateSMim;      // 1 if stream is (re)created
+    int             createfromFITS;  // 1 if stream is created with FITS file size
+    int             resize;          // 1 if existing stream has wrong size and is to be replaced
+    int             fitsOK;          // 1 if FITS file opened
+    int             load;            // 1 if FITS data is to be loaded into stream
+    LOADSHM_FITSMAP fm;
+
+    int             cacheOK;         // 1 if cache record matches stream and file name
+    LOADSHM_CACHE   cache;
+    int             cachewrite;      // 1 if cache record is to be written by loadcreate_finish()
+    uint64_t        hash;            // content hash of FITS file, 0 if unknown
+
+    double          tprepare;        // time spent in loadcreate_prepare() [s]
+    double          tload;           // time spent in loadcreate_load() [s]
+    double          thdr;            // time spent opening file and parsing header [s]
+    double          tio;             // time spent reading (paging in) FITS data [s]
+    double          tconv;           // time spent converting FITS data into stream [s]
+    double          tcopy;           // time spent creating / filling streams [s]
+    double          thash;           // time spent hashing FITS file outside conversion loop [s]
+    long            nbyte;           // FITS data bytes loaded
+
+    int             loadcreatestatus;
+    // value of loadcreatestatus :
     // 0 : existing stream has wrong size -> recreating stream
     // 1 : new stream created and content loaded
     // 2 : existing stream updated
     // 3 : FITS image <fname> has wrong size -> do nothing
     // 4 : FITS image <fname> does not exist, stream <name> exists -> do nothing
     // 5 : FITS image <fname> does not exist, stream <name> does not exist -> create empty stream
+    // 6 : stream exists, size is correct, FITS image unchanged since last load -> do nothing
+} LOADSHM_TASK;
 
 
-    printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-    fflush(stdout);
 
-#ifdef AOLOOPCONTROL_LOGFUNC
-    AOLOOPCONTROL_logfunc_level = 2;
-    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 0, __FILE__, __FUNCTION__, __LINE__, "");
-#endif
 
+/** @brief Monotonic time [s] */
+static double loadcreate_time()
+{
+    struct timespec t;
 
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1.0*t.tv_sec + 1.0e-9*t.tv_nsec;
+}
 
-	// Is present in local mem ?
-	// YES: goto (LOADFITS) 
-	// NO : Can read shared memory ?
-	//      YES: SHM size OK ?
-	//           YES: Load shared memory
-	//                go to (LOADFITS)
-	//           NO : Delete SHM, create new one with correct size [STATUS = 0]
-	//                goto (LOADFITS)
-	//      NO : Create new SHM with correct size [STATUS = 1]
-	//           goto (LOADFITS)
-	//
-	// (LOADFITS)
-	// Can load FITS ?
-	// YES: FITS size OK ?
-	//      YES: Load FITS and write to memory [STATUS = 2] 
-	//      NO : FITS image has wrong size-> do nothing [STATUS = 3]
-	// NO : exit, [STATUS = 4 or 5]
-	//
 
-    ID = image_ID(name);
-    sizearray = (uint32_t *) malloc(sizeof(uint32_t) * 2);
 
-    if(ID == -1) { // if <name> is not loaded in memory
-        printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-        fflush(stdout);
 
-        CreateSMim = 0;
-        ID = read_sharedmem_image(name);
-        printf("------------- ID = %ld\n", (long) ID);
+/** @brief Element size of datatype [bytes], 0 if unknown */
+static size_t shmim_typesize(
+    uint8_t datatype
+)
+{
+    switch(datatype) {
+    case _DATATYPE_UINT8 :
+    case _DATATYPE_INT8 :
+        return 1;
+    case _DATATYPE_UINT16 :
+    case _DATATYPE_INT16 :
+#ifdef _DATATYPE_HALF
+    case _DATATYPE_HALF :
+#endif
+        return 2;
+    case _DATATYPE_UINT32 :
+    case _DATATYPE_INT32 :
+    case _DATATYPE_FLOAT :
+        return 4;
+    case _DATATYPE_UINT64 :
+    case _DATATYPE_INT64 :
+    case _DATATYPE_DOUBLE :
+    case _DATATYPE_COMPLEX_FLOAT :
+        return 8;
+    case _DATATYPE_COMPLEX_DOUBLE :
+        return 16;
+    }
+    return 0;
+}
 
-        if(ID != -1) { // ... and <name> exists as a memory stream
-            list_image_ID();
 
-            printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-            fflush(stdout);
 
-            sizeOK = COREMOD_MEMORY_check_2Dsize(name, xsize, ysize);
 
-            printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-            fflush(stdout);
+/**
+ * @brief Open FITS file and parse primary header, then map file in memory
+ *
+ * Returns 0 on success, -1 if the file cannot be read.\n
+ * Files that cannot be mapped (compressed, or unsupported header) are read with load_fits().
+ */
+static int loadcreate_fits_open(
+    const char      *fname,
+    LOADSHM_FITSMAP *fm
+)
+{
+    struct stat st;
+    size_t hdrlen = 0;
+    int endfound = 0;
+    int simple = 0;
+    int i;
+
+    fm->fd = -1;
+    fm->map = NULL;
+    fm->maplen = 0;
+    fm->data = NULL;
+    fm->IDtmp = -1;
+    fm->bitpix = 0;
+    fm->naxis = 0;
+    for(i=0; i<3; i++)
+        fm->naxes[i] = 1;
+    fm->bzero = 0.0;
+    fm->bscale = 1.0;
+
+    fm->fd = open(fname, O_RDONLY);
+    if(fm->fd == -1)
+        return -1;
+
+    fm->fsize = 0;
+    fm->mtime.tv_sec = 0;
+    fm->mtime.tv_nsec = 0;
+    if(fstat(fm->fd, &st) == 0)
+    {
+        fm->fsize = st.st_size;
+        fm->mtime = st.st_mtim;
+    }
+    if(fm->fsize >= 2880)
+    {
+        fm->maplen = st.st_size;
+        fm->map = (unsigned char*) mmap(NULL, fm->maplen, PROT_READ, MAP_PRIVATE, fm->fd, 0);
+        if(fm->map == MAP_FAILED)
+            fm->map = NULL;
+    }
 
-            if(sizeOK == 0) { // if size is different, delete stream -> create new one
-                char command[500];
+    // parse primary header, 36 cards of 80 char per 2880-byte block
+    if(fm->map != NULL)
+    {
+        simple = (strncmp((char*) fm->map, "SIMPLE  =", 9) == 0) ? 1 : 0;
 
-                printf("\n========== EXISTING %s HAS WRONG SIZE -> CREATING BLANK %s ===========\n\n", name, name);
-                delete_image_ID(name);
+        while((simple == 1)&&(endfound == 0)&&(hdrlen+2880 <= fm->maplen))
+        {
+            int card;
 
-                if(sprintf(command, "rm %s/%s.im.shm", data.shmdir, name) < 1) {
-                    printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
-                }
+            for(card=0; card<36; card++)
+            {
+                const char *c = (const char*) fm->map + hdrlen + 80*card;
+                char value[71];
 
-                if(system(command) != 0) {
-                    printERROR(__FILE__, __func__, __LINE__, "system() error");
+                if((strncmp(c, "END", 3) == 0)&&(c[3] == ' '))
+                {
+                    endfound = 1;
+                    break;
                 }
-
-                CreateSMim = 1;
-                loadcreatestatus = 0;
+                if(c[8] != '=')
+                    continue;
+
+                memcpy(value, c+10, 70);
+                value[70] = '\0';
+
+                if(strncmp(c, "BITPIX  ", 8) == 0)
+                    fm->bitpix = atoi(value);
+                else if(strncmp(c, "NAXIS   ", 8) == 0)
+                    fm->naxis = atoi(value);
+                else if((strncmp(c, "NAXIS", 5) == 0)&&(c[5] >= '1')&&(c[5] <= '3')&&(c[6] == ' '))
+                    fm->naxes[c[5]-'1'] = atol(value);
+                else if(strncmp(c, "BZERO   ", 8) == 0)
+                    fm->bzero = strtod(value, NULL);
+                else if(strncmp(c, "BSCALE  ", 8) == 0)
+                    fm->bscale = strtod(value, NULL);
             }
-        } else { //  ... and <name> does not exist as a stream -> create new stream
-            CreateSMim = 1;
-            loadcreatestatus = 1;
+            hdrlen += 2880;
         }
 
-        printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-        fflush(stdout);
-
-        if(CreateSMim == 1) {
-            sizearray[0] =  xsize;
-            sizearray[1] =  ysize;
-            if(xsize * ysize > 0) {
-                ID = create_image_ID(name, 2, sizearray, _DATATYPE_FLOAT, 1, 0);
-            }
-            for(ii = 0; ii < xsize * ysize; ii++) {
-                data.image[ID].array.F[ii] = DefaultValue;
-            }
+        fm->bytepix = abs(fm->bitpix)/8;
+        fm->nelem = fm->naxes[0]*fm->naxes[1]*fm->naxes[2];
+        if((endfound == 0)||(fm->naxis < 1)||(fm->naxis > 3)||(fm->nelem < 1)
+                ||((fm->bitpix != 8)&&(fm->bitpix != 16)&&(fm->bitpix != 32)&&(fm->bitpix != 64)&&(fm->bitpix != -32)&&(fm->bitpix != -64))
+                ||(hdrlen + fm->nelem*fm->bytepix > fm->maplen))
+        {
+            munmap(fm->map, fm->maplen);
+            fm->map = NULL;
+        }
+        else
+        {
+            fm->data = fm->map + hdrlen;
+            madvise(fm->map, fm->maplen, MADV_SEQUENTIAL);
         }
     }
-    free(sizearray);
+    close(fm->fd);
+    fm->fd = -1;
+
+
+    // fall back to cfitsio
+    if(fm->map == NULL)
+    {
+        // unique name : several files may be open at once (batch loader)
+        sprintf(fm->tmpname, "_tmploadshm%ld", __sync_fetch_and_add(&loadcreate_tmpcnt, 1));
+        fm->IDtmp = load_fits(fname, fm->tmpname, 3);
+        if(fm->IDtmp == -1)
+            return -1;
+
+        fm->bitpix = -32;
+        fm->bytepix = 4;
+        fm->naxis = data.image[fm->IDtmp].md[0].naxis;
+        for(i=0; i<fm->naxis; i++)
+            fm->naxes[i] = data.image[fm->IDtmp].md[0].size[i];
+        fm->nelem = data.image[fm->IDtmp].md[0].nelement;
+    }
 
-    printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-    fflush(stdout);
+    return 0;
+}
 
 
-    if(ID == -1) {
-        printf("ERROR: could not load/create %s\n", name);
-        printf("Function %s\n", __func__);
-        printf("INPUT : \n");
-        printf("   name         = \"%s\"\n", name);
-        printf("   fname        = \"%s\"\n", fname);
-        printf("   xsize        = %ld\n", xsize);
-        printf("   ysize        = %ld\n", ysize);
-        printf("   DefaultValue = %f\n", DefaultValue);
-        printf("\n");
-        exit(0);
-    } else {
-        long ID1;
 
-        ID1 = load_fits(fname, "tmp2Dim", 3);  
 
-        if(ID1 != -1) {
-            sizeOK = COREMOD_MEMORY_check_2Dsize("tmp2Dim", xsize, ysize);
-            if(sizeOK == 1) {
-                memcpy(data.image[ID].array.F, data.image[ID1].array.F, sizeof(float)*xsize * ysize);
-                printf("loaded file \"%s\" to shared memory \"%s\"\n", fname, name);
-                loadcreatestatus = 2;
-            } else {
-                printf("File \"%s\" has wrong size (should be 2-D %ld x %ld,  is %d-D %ld x %ld): ignoring\n", fname, xsize, ysize, (int) data.image[ID1].md[0].naxis, (long) data.image[ID1].md[0].size[0], (long) data.image[ID1].md[0].size[1]);
-                loadcreatestatus = 3;
-            }
-            delete_image_ID("tmp2Dim");
-        } else {
-            if(CreateSMim == 0) {
-                loadcreatestatus = 4;
-            } else {
-                loadcreatestatus = 5;
-            }
+/** @brief Unmap FITS file, or delete temporary image */
+static void loadcreate_fits_close(
+    LOADSHM_FITSMAP *fm
+)
+{
+    if(fm->map != NULL)
+        munmap(fm->map, fm->maplen);
+    fm->map = NULL;
+
+    if(fm->IDtmp != -1)
+        delete_image_ID(fm->tmpname);
+    fm->IDtmp = -1;
+}
+
+
+
+
+/** @brief Convert n FITS data elements, starting at element offset, to double
+ *
+ * FITS data is big-endian, scaled by BSCALE and BZERO.
+ */
+static void loadcreate_fits_read_double(
+    const LOADSHM_FITSMAP *fm,
+    long                   offset,
+    long                   n,
+    double *restrict       dst
+)
+{
+    const unsigned char *src = fm->data + offset*fm->bytepix;
+    double bscale = fm->bscale;
+    double bzero = fm->bzero;
+    long ii;
+
+    if(fm->IDtmp != -1)
+    {
+        if(data.image[fm->IDtmp].md[0].datatype == _DATATYPE_DOUBLE)
+            memcpy(dst, data.image[fm->IDtmp].array.D + offset, sizeof(double)*n);
+        else
+            for(ii=0; ii<n; ii++)
+                dst[ii] = data.image[fm->IDtmp].array.F[offset+ii];
+        return;
+    }
+
+    switch (fm->bitpix) {
+    case 8 :
+        for(ii=0; ii<n; ii++)
+            dst[ii] = bscale*src[ii] + bzero;
+        break;
+    case 16 :
+        for(ii=0; ii<n; ii++)
+        {
+            uint16_t v;
+            memcpy(&v, src + 2*ii, 2);
+            dst[ii] = bscale*((int16_t) be16toh(v)) + bzero;
+        }
+        break;
+    case 32 :
+        for(ii=0; ii<n; ii++)
+        {
+            uint32_t v;
+            memcpy(&v, src + 4*ii, 4);
+            dst[ii] = bscale*((int32_t) be32toh(v)) + bzero;
+        }
+        break;
+    case 64 :
+        for(ii=0; ii<n; ii++)
+        {
+            uint64_t v;
+            memcpy(&v, src + 8*ii, 8);
+            dst[ii] = bscale*((int64_t) be64toh(v)) + bzero;
+        }
+        break;
+    case -32 :
+        for(ii=0; ii<n; ii++)
+        {
+            uint32_t v;
+            float f;
+            memcpy(&v, src + 4*ii, 4);
+            v = be32toh(v);
+            memcpy(&f, &v, 4);
+            dst[ii] = bscale*f + bzero;
         }
+        break;
+    case -64 :
+        for(ii=0; ii<n; ii++)
+        {
+            uint64_t v;
+            double d;
+            memcpy(&v, src + 8*ii, 8);
+            v = be64toh(v);
+            memcpy(&d, &v, 8);
+            dst[ii] = bscale*d + bzero;
+        }
+        break;
     }
+}
 
 
-    printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-    fflush(stdout);
 
-    // logging
 
+/** @brief Convert float to IEEE 754 half precision (round to nearest even) */
+static inline uint16_t loadcreate_float2half(
+    float f
+)
+{
+    uint32_t x;
+    uint32_t sign;
+    uint32_t mant;
+    int32_t  e;
+
+    memcpy(&x, &f, 4);
+    sign = (x >> 16) & 0x8000;
+    e = (int32_t) ((x >> 23) & 0xff) - 127 + 15;
+    mant = x & 0x7fffff;
+
+    if(((x >> 23) & 0xff) == 0xff)        // inf, nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if(e >= 31)                           // overflow
+        return sign | 0x7c00;
+    if(e <= 0) {                          // subnormal or zero
+        uint32_t shift;
+        uint32_t h;
+
+        if(e < -10)
+            return sign;
+        mant |= 0x800000;
+        shift = 14 - e;
+        h = mant >> shift;
+        if(((mant >> (shift-1)) & 1) && ((mant & ((1u << (shift-1)) - 1)) || (h & 1)))
+            h++;
+        return sign | h;
+    }
+    {
+        uint32_t h = ((uint32_t) e << 10) | (mant >> 13);
 
-    if(loadcreateshm_log == 1) { // results should be logged in ASCII file
-        switch(loadcreatestatus) {
-            case 0 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream has wrong size -> recreating stream\n", fname, name);
-                break;
-            case 1 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: new stream created and content loaded\n", fname, name);
-                break;
-            case 2 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream updated\n", fname, name);
-                break;
-            case 3 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image has wrong size -> do nothing\n", fname, name);
-                break;
-            case 4 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream exists -> do nothing\n", fname, name);
-                break;
-            case 5 :
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream does not exist -> create empty stream\n", fname, name);
-                break;
-            default:
-                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: UNKNOWN ERROR CODE\n", fname, name);
-                break;
-        }
+        if((mant & 0x1000) && ((mant & 0x2fff)))   // round to nearest even, may carry into exponent
+            h++;
+        return sign | h;
     }
+}
+
 
 
-#ifdef AOLOOPCONTROL_LOGFUNC
-    AOLOOPCONTROL_logfunc_level = 2;
-    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 1, __FILE__, __FUNCTION__, __LINE__, "");
-#endif
 
-    printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, name, fname, loadcreatestatus);
-    fflush(stdout);
+/** @brief Store n double values into stream array of given datatype, starting at element offset
+ *
+ * Integer datatypes are rounded to nearest and clamped to their range, NaN is stored as 0.
+ */
+static void loadcreate_store(
+    const double *restrict src,
+    long                   n,
+    uint8_t                datatype,
+    void                  *array,
+    long                   offset
+)
+{
+    long ii;
 
+#define LOADCREATE_STORE_INT(type, vmin, vmax) { \
+        type *restrict dst = ((type*) array) + offset; \
+        for(ii=0; ii<n; ii++) { \
+            double v = nearbyint(src[ii]); \
+            v = (v == v) ? v : 0.0; \
+            v = (v < (vmin)) ? (vmin) : v; \
+            v = (v > (vmax)) ? (vmax) : v; \
+            dst[ii] = (type) v; \
+        } \
+    }
 
-    return ID;
+    switch(datatype) {
+    case _DATATYPE_UINT8 :
+        LOADCREATE_STORE_INT(uint8_t, 0.0, 255.0);
+        break;
+    case _DATATYPE_INT8 :
+        LOADCREATE_STORE_INT(int8_t, -128.0, 127.0);
+        break;
+    case _DATATYPE_UINT16 :
+        LOADCREATE_STORE_INT(uint16_t, 0.0, 65535.0);
+        break;
+    case _DATATYPE_INT16 :
+        LOADCREATE_STORE_INT(int16_t, -32768.0, 32767.0);
+        break;
+    case _DATATYPE_UINT32 :
+        LOADCREATE_STORE_INT(uint32_t, 0.0, 4294967295.0);
+        break;
+    case _DATATYPE_INT32 :
+        LOADCREATE_STORE_INT(int32_t, -2147483648.0, 2147483647.0);
+        break;
+    case _DATATYPE_UINT64 :
+        LOADCREATE_STORE_INT(uint64_t, 0.0, 18446744073709549568.0);
+        break;
+    case _DATATYPE_INT64 :
+        LOADCREATE_STORE_INT(int64_t, -9223372036854775808.0, 9223372036854774784.0);
+        break;
+#ifdef _DATATYPE_HALF
+    case _DATATYPE_HALF : {
+        uint16_t *restrict dst = ((uint16_t*) array) + offset;
+        for(ii=0; ii<n; ii++)
+            dst[ii] = loadcreate_float2half((float) src[ii]);
+        break;
+    }
+#endif
+    case _DATATYPE_DOUBLE :
+        memcpy(((double*) array) + offset, src, sizeof(double)*n);
+        break;
+    default : {    // _DATATYPE_FLOAT
+        float *restrict dst = ((float*) array) + offset;
+        for(ii=0; ii<n; ii++)
+            dst[ii] = (float) src[ii];
+        break;
+    }
+    }
+
+#undef LOADCREATE_STORE_INT
 }
 
 
 
 
+/** @brief Convert n FITS data elements, starting at element offset, into stream array
+ *
+ * Data goes through a LOADSHM_CONVBLOCK-element double buffer, kept in L1/L2 cache,
+ * so that decoding and conversion loops are both simple enough to be vectorized.
+ */
+static void loadcreate_fits_read(
+    const LOADSHM_FITSMAP *fm,
+    long                   offset,
+    long                   n,
+    uint8_t                datatype,
+    void                  *array
+)
+{
+    double buf[LOADSHM_CONVBLOCK];
+    long k;
+
+    for(k=0; k<n; k+=LOADSHM_CONVBLOCK)
+    {
+        long nb = n-k;
+
+        if(nb > LOADSHM_CONVBLOCK)
+            nb = LOADSHM_CONVBLOCK;
+        loadcreate_fits_read_double(fm, offset+k, nb, buf);
+        loadcreate_store(buf, nb, datatype, array, offset+k);
+    }
+}
 
 
 
 
-long AOloopControl_IOtools_3Dloadcreate_shmim(
-    const char *name,
-    const char *fname,
-    long xsize,
-    long ysize,
-    long zsize,
-    float DefaultValue
-) {
-    long ID;
-    int CreateSMim;
-    int sizeOK;
-    uint32_t *sizearray;
-    long ID1;
-    int creashmimfromFITS = 0;
+/** @brief Fill nelem elements of stream array with value, converted to datatype */
+static void loadcreate_fill(
+    void    *array,
+    long     nelem,
+    uint8_t  datatype,
+    double   value
+)
+{
+    size_t typesize = shmim_typesize(datatype);
     long ii;
 
-    int loadcreatestatus = -1;
-    // value of loadcreatestatus :
-    // 0 : existing stream has wrong size -> recreating stream
-    // 1 : new stream created and content loaded
-    // 2 : existing stream updated
-    // 3 : FITS image <fname> has wrong size -> do nothing
-    // 4 : FITS image <fname> does not exist, stream <name> exists -> do nothing
-    // 5 : FITS image <fname> does not exist, stream <name> does not exist -> create empty stream
-    // 6 : stream exists, size is correct
+    if(nelem < 1)
+        return;
+    loadcreate_store(&value, 1, datatype, array, 0);
+    for(ii=1; ii<nelem; ii++)
+        memcpy((char*) array + ii*typesize, array, typesize);
+}
 
 
 
-#ifdef AOLOOPCONTROL_LOGFUNC
-    AOLOOPCONTROL_logfunc_level = 2;
-    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 0, __FILE__, __FUNCTION__, __LINE__, "");
-#endif
 
+/** @brief 64-bit hash of n bytes */
+static uint64_t loadcreate_hash_bytes(
+    const unsigned char *p,
+    size_t               n
+)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for(i=0; i+8<=n; i+=8)
+    {
+        uint64_t w;
+
+        memcpy(&w, p+i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for(; i<n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
 
-    printf("-------- ENTERING AOloopControl_3Dloadcreate_shmim   name = %s ----------\n", name);
-    fflush(stdout);
+    return h;
+}
 
-    list_image_ID();
 
 
-    ID = image_ID(name);
-    sizearray = (uint32_t *) malloc(sizeof(uint32_t) * 3);
 
-    printf("        ENTERING AOloopControl_3Dloadcreate_shmim: ============== %ld  %ld  %ld ===== %ld ======\n", xsize, ysize, zsize, ID);
-    fflush(stdout);
+/** @brief Number of data chunks of mapped FITS file, LOADSHM_CHUNKSIZE elements each */
+static long loadcreate_fits_NBchunk(
+    const LOADSHM_FITSMAP *fm
+)
+{
+    return (fm->nelem + LOADSHM_CHUNKSIZE - 1)/LOADSHM_CHUNKSIZE;
+}
 
-    if(ID == -1) {
-        CreateSMim = 0;
-        ID = read_sharedmem_image(name);
 
-        printf("        AOloopControl_3Dloadcreate_shmim: ============== %ld  ======\n", ID);
-        fflush(stdout);
 
 
-        if(ID != -1) { // stream exists
+/** @brief Hash of data chunk k of mapped FITS file (raw file bytes) */
+static uint64_t loadcreate_fits_chunkhash(
+    const LOADSHM_FITSMAP *fm,
+    long                   k
+)
+{
+    long n = fm->nelem - k*LOADSHM_CHUNKSIZE;
 
-            sizeOK = COREMOD_MEMORY_check_3Dsize(name, xsize, ysize, zsize);
-            if(sizeOK == 0) {
-                char command[500];
+    if(n > LOADSHM_CHUNKSIZE)
+        n = LOADSHM_CHUNKSIZE;
 
-                //               printf("\n========== EXISTING %s HAS WRONG SIZE -> CREATING BLANK %s ===========\n\n", name, name);
-                printf("        AOloopControl_3Dloadcreate_shmim: ===== EXISTING %s HAS WRONG SIZE -> CREATING BLANK %s\n", name, name);
-                fflush(stdout);
+    return loadcreate_hash_bytes(fm->data + k*LOADSHM_CHUNKSIZE*fm->bytepix, n*fm->bytepix);
+}
 
-                delete_image_ID(name);
 
-                if(sprintf(command, "rm %s/%s.im.shm", data.shmdir, name) < 1) {
-                    printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
-                }
 
-                if(system(command) != 0) {
-                    printERROR(__FILE__, __func__, __LINE__, "system() returns non-zero value");
-                }
 
-                CreateSMim = 1;
-                loadcreatestatus = 0;
-            } else { // SIZE OK
-                printf("        AOloopControl_3Dloadcreate_shmim: ===== SIZE OK\n");
-                fflush(stdout);
-                CreateSMim = 0;
-                loadcreatestatus = 2;
-            }
-        } else {
-            CreateSMim = 1;
-            loadcreatestatus = 1;
-        }
-
-        if(CreateSMim == 1) {
-            sizearray[0] = xsize;
-            sizearray[1] = ysize;
-            sizearray[2] = zsize;
-            if(xsize * ysize * zsize > 0) {
-                printf("        AOloopControl_3Dloadcreate_shmim: ===== create_image_ID\n");
-                fflush(stdout);
-                ID = create_image_ID(name, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
-                for(ii = 0; ii < xsize * ysize * zsize; ii++) {
-                    data.image[ID].array.F[ii] = DefaultValue;
-                }
-                creashmimfromFITS = 0;
-            } else {
-                creashmimfromFITS = 1;
-            }
-        }
-    }
-    free(sizearray);
+/**
+ * @brief Combine chunk hashes into content hash of mapped FITS file
+ *
+ * chunkhash holds NBchunk+2 entries: chunkhash[1..NBchunk] are the data chunk hashes,
+ * entries 0 (header) and NBchunk+1 (padding after data) are computed here.
+ * Hashes are combined in file order, result is never 0.
+ */
+static uint64_t loadcreate_fits_hash_combine(
+    const LOADSHM_FITSMAP *fm,
+    uint64_t              *chunkhash
+)
+{
+    long NBchunk = loadcreate_fits_NBchunk(fm);
+    size_t hdrlen = fm->data - fm->map;
+    size_t datalen = fm->nelem*fm->bytepix;
+    uint64_t h;
+
+    chunkhash[0] = loadcreate_hash_bytes(fm->map, hdrlen);
+    if(fm->maplen > hdrlen + datalen)
+        chunkhash[NBchunk+1] = loadcreate_hash_bytes(fm->data + datalen, fm->maplen - hdrlen - datalen);
+    else
+        chunkhash[NBchunk+1] = loadcreate_hash_bytes(NULL, 0);
+
+    h = loadcreate_hash_bytes((unsigned char*) chunkhash, sizeof(uint64_t)*(NBchunk+2));
+    if(h == 0)
+        h = 1;
+
+    return h;
+}
 
 
-    printf("        AOloopControl_3Dloadcreate_shmim: ===== TEST pt\n");
-    fflush(stdout);
 
-    // here, ID is either loaded, or it should be created from FITS image
-    if((ID == -1) && (creashmimfromFITS == 0)) {
-        printf("ERROR: could not load/create %s\n", name);
-        exit(0);
+
+/**
+ * @brief Content hash of mapped FITS file
+ *
+ * Data unit is hashed in chunks of LOADSHM_CHUNKSIZE elements (the conversion chunks,
+ * so loadcreate_load can hash while converting), distributed over threads if
+ * parallel = 1. Returns 0 if the file is not mapped.
+ */
+static uint64_t loadcreate_fits_hash(
+    const LOADSHM_FITSMAP *fm,
+    int                    parallel
+)
+{
+    long NBchunk;
+    uint64_t *chunkhash;
+    uint64_t h;
+    long k;
+
+    if(fm->map == NULL)
+        return 0;
+
+    NBchunk = loadcreate_fits_NBchunk(fm);
+    chunkhash = (uint64_t*) malloc(sizeof(uint64_t)*(NBchunk+2));
+    if(chunkhash == NULL)
+        return 0;
+
+# ifdef _OPENMP
+    #pragma omp parallel for if ((parallel == 1)&&(NBchunk>1))
+# endif
+    for(k=0; k<NBchunk; k++)
+        chunkhash[k+1] = loadcreate_fits_chunkhash(fm, k);
+
+    h = loadcreate_fits_hash_combine(fm, chunkhash);
+    free(chunkhash);
+
+    return h;
+}
+
+
+
+
+/** @brief Load cache sidecar file name of stream */
+static void loadcreate_cache_fname(
+    const char *name,
+    char       *cachefname
+)
+{
+    if(sprintf(cachefname, "%s/%s.im.shm.loadcache", data.shmdir, name) < 1) {
+        printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
     }
+}
 
-    ID1 = load_fits(fname, "tmp3Dim", 3);
-    printf("        AOloopControl_3Dloadcreate_shmim: ===== ID1 = %ld\n", ID1);
-    fflush(stdout);
-    if(ID1 != -1) {
-        if(creashmimfromFITS == 1) { // create shared mem from FITS
-            sizeOK = COREMOD_MEMORY_check_3Dsize("tmp3Dim", xsize, ysize, zsize);
-            printf("        AOloopControl_3Dloadcreate_shmim: ===== sizeOK = %d\n", (int) sizeOK);
-            fflush(stdout);
-            if(sizeOK == 1) {
-                long xsize1, ysize1, zsize1;
 
-                xsize1 = data.image[ID1].md[0].size[0];
-                ysize1 = data.image[ID1].md[0].size[1];
-                zsize1 = data.image[ID1].md[0].size[2];
-                sizearray[0] = xsize1;
-                sizearray[1] = ysize1;
-                sizearray[2] = zsize1;
-                ID = create_image_ID(name, 3, sizearray, _DATATYPE_FLOAT, 1, 0);
 
-                printf("        AOloopControl_3Dloadcreate_shmim: ===== [1] memcpy  %ld %ld %ld\n", xsize1, ysize1, zsize1);
-                fflush(stdout);
 
-                memcpy(data.image[ID].array.F, data.image[ID1].array.F, sizeof(float)*xsize1 * ysize1 * zsize1);
+/** @brief Read load cache record of stream, returns 0 on success */
+static int loadcreate_cache_read(
+    const char    *name,
+    LOADSHM_CACHE *cache
+)
+{
+    char cachefname[500];
+    FILE *fp;
+    int NBread;
 
-                printf("        AOloopControl_3Dloadcreate_shmim: ===== [1] memcpy  DONE\n");
-                fflush(stdout);
+    loadcreate_cache_fname(name, cachefname);
+    fp = fopen(cachefname, "r");
+    if(fp == NULL)
+        return -1;
 
-                loadcreatestatus = 1;
-            } else {
-                printf("File \"%s\" has wrong size (should be 3-D %ld x %ld, x %ld  is %d-D %ld x %ld x %ld): ignoring\n", fname, xsize, ysize, zsize, (int) data.image[ID1].md[0].naxis, (long) data.image[ID1].md[0].size[0], (long) data.image[ID1].md[0].size[1], (long) data.image[ID1].md[0].size[2]);
-                loadcreatestatus = 3;
-            }
-        } else {
-            printf("        AOloopControl_3Dloadcreate_shmim: ===== [2] memcpy %ld <- %ld     %ld %ld %ld\n", ID, ID1, xsize, ysize, zsize);
-            fflush(stdout);
-            list_image_ID();
+    NBread = fscanf(fp, "%499s %ld %ld %ld %" SCNu64 " %" SCNu64 " %" SCNu64 " %ld %ld", cache->fname, &cache->fsize, &cache->mtime_sec, &cache->mtime_nsec, &cache->hash, &cache->cnt0,
+                    &cache->generation, &cache->ctime_sec, &cache->ctime_nsec);
+    fclose(fp);
+
+    return (NBread == 9) ? 0 : -1;
+}
 
-            memcpy(data.image[ID].array.F, data.image[ID1].array.F, sizeof(float)*xsize * ysize * zsize);
 
-            printf("        AOloopControl_3Dloadcreate_shmim: ===== [2] memcpy  DONE\n");
-            fflush(stdout);
 
-            loadcreatestatus = 2;
-        }
-        delete_image_ID("tmp3Dim");
-    } else {
-        if(CreateSMim == 0) {
-            loadcreatestatus = 4;
-        } else {
-            loadcreatestatus = 5;
-        }
+
+/** @brief Write load cache record of stream */
+static void loadcreate_cache_write(
+    const char          *name,
+    const LOADSHM_CACHE *cache
+)
+{
+    char cachefname[500];
+    FILE *fp;
+
+    loadcreate_cache_fname(name, cachefname);
+    fp = fopen(cachefname, "w");
+    if(fp == NULL)
+        return;
+
+    fprintf(fp, "%s %ld %ld %ld %" PRIu64 " %" PRIu64 " %" PRIu64 " %ld %ld\n", cache->fname, cache->fsize, cache->mtime_sec, cache->mtime_nsec, cache->hash, cache->cnt0,
+            cache->generation, cache->ctime_sec, cache->ctime_nsec);
+    fclose(fp);
+}
+
+
+
+
+/** @brief Delete load cache record of stream */
+static void loadcreate_cache_delete(
+    const char *name
+)
+{
+    char cachefname[500];
+
+    loadcreate_cache_fname(name, cachefname);
+    unlink(cachefname);
+}
+
+
+
+
+/** @brief Returns 1 if shared memory stream name has size naxis / size, 0 otherwise */
+static int loadcreate_checksize(
+    const char *name,
+    int         naxis,
+    const long *size
+)
+{
+    if(naxis == 2)
+        return COREMOD_MEMORY_check_2Dsize(name, size[0], size[1]);
+    else
+        return COREMOD_MEMORY_check_3Dsize(name, size[0], size[1], size[2]);
+}
+
+
+
+
+/**
+ * @brief Delete stream and its shared memory file, in-process
+ *
+ * Processes attached to the stream are notified before the file is removed : the stream
+ * generation counter (cnt2) is incremented and all semaphores are posted, so that readers
+ * waiting on the stream wake up, see the new generation, and can reconnect.\n
+ * Returns the generation of the stream replacing it.
+ */
+static uint64_t shmim_delete(
+    const char *name,
+    long        ID
+)
+{
+    char fname[500];
+    uint64_t generation;
+
+    generation = data.image[ID].md[0].cnt2 + 1;
+    data.image[ID].md[0].cnt2 = generation;
+    COREMOD_MEMORY_image_set_sempost_byID(ID, -1);
+
+    if(sprintf(fname, "%s/%s.im.shm", data.shmdir, name) < 1) {
+        printERROR(__FILE__, __func__, __LINE__, "sprintf wrote <1 char");
     }
 
+    delete_image_ID(name);
+    if((unlink(fname) != 0) && (errno != ENOENT)) {
+        printERROR(__FILE__, __func__, __LINE__, "unlink() error");
+    }
 
-    if(loadcreateshm_log == 1) { // results should be logged in ASCII file
-        switch(loadcreatestatus) {
-        case 0 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream has wrong size -> recreating stream\n", fname, name);
-            break;
-        case 1 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: new stream created and content loaded\n", fname, name);
-            break;
-        case 2 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream updated\n", fname, name);
-            break;
-        case 3 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image has wrong size -> do nothing\n", fname, name);
-            break;
-        case 4 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream exists -> do nothing\n", fname, name);
-            break;
-        case 5 :
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream does not exist -> create empty stream\n", fname, name);
-            break;
-        default:
-            fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: UNKNOWN ERROR CODE\n", fname, name);
-            break;
-        }
+    return generation;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Resize (recreate) shared memory stream, without external process
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * name		CHAR*
+ * 			Stream name
+ * 
+ * @param[in]
+ * naxis	LONG
+ * 			Number of axes of new stream
+ * 
+ * @param[in]
+ * size		UINT32*
+ * 			Size of new stream
+ * 
+ * @param[in]
+ * datatype	UINT8
+ * 			Datatype of new stream, 0 to keep current datatype (FLOAT if stream does not exist)
+ * 
+ * 
+ * ## Details
+ * 
+ * If the stream exists (in local memory or as shared memory file), its generation counter
+ * (cnt2) is incremented and its semaphores posted, then it is deleted and its file unlinked.
+ * The new stream is created with the same number of semaphores, and with generation counter
+ * cnt2 = old generation + 1.\n * Returns new stream ID, -1 if naxis is not 1, 2 or 3 (existing stream is then left untouched).\n
+ * Readers should record cnt2 when attaching to a stream, and reconnect (read_sharedmem_image)
+ * when it changes.
+ * 
+ */
+
+long AOloopControl_IOtools_shmim_resize(
+    const char     *name,
+    long            naxis,
+    const uint32_t *size,
+    uint8_t         datatype
+)
+{
+    long ID;
+    uint64_t generation = 0;
+    int NBsem = 0;
+    uint32_t sizearray[3];
+    int i;
+
+    if((naxis < 1) || (naxis > 3)) {
+        printf("ERROR: stream \"%s\": cannot resize to naxis = %ld\n", name, naxis);
+        return -1;
     }
 
+    ID = image_ID(name);
+    if(ID == -1)
+        ID = read_sharedmem_image(name);
 
-    printf("-------- EXITING AOloopControl_3Dloadcreate_shmim ----------\n");
-    fflush(stdout);
+    loadcreate_cache_delete(name);   // load cache record no longer describes the stream
 
+    if(ID != -1) {
+        if(datatype == 0)
+            datatype = data.image[ID].md[0].datatype;
+        NBsem = data.image[ID].md[0].sem;
+        generation = shmim_delete(name, ID);
+    }
+    if(datatype == 0)
+        datatype = _DATATYPE_FLOAT;
 
-#ifdef AOLOOPCONTROL_LOGFUNC
-    AOLOOPCONTROL_logfunc_level = 2;
-    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 1, __FILE__, __FUNCTION__, __LINE__, "");
-#endif
+    for(i=0; i<naxis; i++)
+        sizearray[i] = size[i];
+    ID = create_image_ID(name, naxis, sizearray, datatype, 1, 0);
+    data.image[ID].md[0].cnt2 = generation;
+    if(NBsem > 0)
+        COREMOD_MEMORY_image_set_createsem(name, NBsem);
 
     return ID;
 }
 
+
+
+
+/** @brief Create stream of task (datatype, size naxis / size), replacing existing stream if task->resize = 1
+ *
+ * 3D streams are created flagged as being loaded (write = 1, no slice available, see loadcreate_load()),
+ * as a FITS load may follow : loadcreate_prepare() clears the flag if it does not.
+ */
+static void loadcreate_createstream(
+    LOADSHM_TASK *task,
+    const long   *size
+)
+{
+    uint32_t sizearray[3];
+    int i;
+
+    for(i=0; i<task->naxis; i++)
+        sizearray[i] = size[i];
+
+    if(task->resize == 1)
+        task->ID = AOloopControl_IOtools_shmim_resize(task->name, task->naxis, sizearray, task->datatype);
+    else
+        task->ID = create_image_ID(task->name, task->naxis, sizearray, task->datatype, 1, 0);
+    task->resize = 0;
+
+    if(task->naxis == 3) {
+        data.image[task->ID].md[0].cnt1 = LOADSHM_NOSLICE;
+        data.image[task->ID].md[0].write = 1;
+    }
+}
+
+
+
+
+/**
+ * @brief Resolve or create stream, open FITS file and decide what to load
+ *
+ * Implements stream loading policy :
+ * 
+ * (1) If stream is in local memory or can be read from shared memory, with correct size and datatype, use it.
+ *     If it exists with wrong size or datatype, replace it with AOloopControl_IOtools_shmim_resize() [STATUS = 0].
+ *     If it does not exist, create it [STATUS = 1].
+ *     New streams are filled with DefaultValue. A 3D stream of size 0 x 0 x 0 is created with the FITS file size.
+ * (2) If FITS file can be read and has correct size, it will be loaded [STATUS = 2 or 1 if stream created from FITS],
+ *     otherwise do nothing [STATUS = 3].
+ * (3) If FITS file cannot be read [STATUS = 4 if stream existed, 5 otherwise]
+ * 
+ * Load cache : a record of the last FITS file loaded into the stream (name, size, modification time,
+ * content hash, stream cnt0 after load, stream generation and creation time) is kept in sidecar file
+ * <shmdir>/<stream>.im.shm.loadcache. Generation and creation time identify the stream, so that a
+ * stream recreated elsewhere does not match the record when its cnt0 happens to be the same.
+ * If the stream was not recreated, and neither the stream (cnt0) nor the file changed since, the
+ * file is not read [STATUS = 6]. If only the file modification time changed, the file is hashed
+ * and is not loaded if its content is unchanged.
+ * 
+ * All image table operations (stream lookup / creation) are done here, FITS data is loaded
+ * by loadcreate_load().
+ */
+static void loadcreate_prepare(
+    LOADSHM_TASK *task
+)
+{
+    long nelem = task->size[0]*task->size[1];
+    int i;
+
+    if(task->naxis == 3)
+        nelem *= task->size[2];
+
+    task->loadcreatestatus = -1;
+    task->CreateSMim = 0;
+    task->createfromFITS = 0;
+    task->resize = 0;
+    task->load = 0;
+    task->cacheOK = 0;
+    task->cachewrite = 0;
+    task->hash = 0;
+
+    if(loadcreate_verbose > 1) {
+        printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, task->name, task->fname, task->loadcreatestatus);
+        fflush(stdout);
+    }
+
+    task->ID = image_ID(task->name);
+    if(task->ID == -1) { // if <name> is not loaded in memory
+        task->ID = read_sharedmem_image(task->name);
+        if((task->ID != -1) && (loadcreate_verbose > 1)) // ... and <name> exists as a memory stream
+            list_image_ID();
+    }
+
+    // <name> in local memory or memory stream : data is converted into it, size and datatype must match
+    if(task->ID != -1) {
+        if((loadcreate_checksize(task->name, task->naxis, task->size) == 0)
+                || (data.image[task->ID].md[0].datatype != task->datatype)) { // if size or datatype is different, replace stream
+            if(loadcreate_verbose > 1)
+                printf("\n========== EXISTING %s HAS WRONG SIZE OR DATATYPE -> CREATING BLANK %s ===========\n\n", task->name, task->name);
+            loadcreate_cache_delete(task->name);
+            task->resize = 1;
+            task->CreateSMim = 1;
+            task->loadcreatestatus = 0;
+        }
+    } else { //  <name> does not exist -> create new stream
+        task->CreateSMim = 1;
+        task->loadcreatestatus = 1;
+    }
+
+    if(task->CreateSMim == 1) {
+        if(nelem > 0) {
+            double t0 = loadcreate_time();
+
+            loadcreate_createstream(task, task->size);
+            loadcreate_fill(data.image[task->ID].array.raw, nelem, task->datatype, task->DefaultValue);
+            task->tcopy += loadcreate_time() - t0;
+        } else {
+            task->createfromFITS = 1;
+        }
+    }
+
+    if((task->ID == -1) && (task->createfromFITS == 0)) {
+        printf("ERROR: could not load/create %s\n", task->name);
+        printf("Function %s\n", __func__);
+        printf("INPUT : \n");
+        printf("   name         = \"%s\"\n", task->name);
+        printf("   fname        = \"%s\"\n", task->fname);
+        for(i=0; i<task->naxis; i++)
+            printf("   size[%d]      = %ld\n", i, task->size[i]);
+        printf("   DefaultValue = %f\n", task->DefaultValue);
+        printf("   datatype     = %d\n", (int) task->datatype);
+        printf("\n");
+        exit(0);
+    }
+
+
+    // load cache : stream unchanged since last load of same file ?
+    if((task->CreateSMim == 0) && (loadcreate_cache_read(task->name, &task->cache) == 0)
+            && (strcmp(task->cache.fname, task->fname) == 0)
+            && (task->cache.cnt0 == data.image[task->ID].md[0].cnt0)
+            && (task->cache.generation == data.image[task->ID].md[0].cnt2)
+            && (task->cache.ctime_sec == (long) data.image[task->ID].md[0].creationtime.tv_sec)
+            && (task->cache.ctime_nsec == (long) data.image[task->ID].md[0].creationtime.tv_nsec)) {
+        struct stat st;
+
+        task->cacheOK = 1;
+        if((stat(task->fname, &st) == 0) && (st.st_size == task->cache.fsize)
+                && (st.st_mtim.tv_sec == task->cache.mtime_sec) && (st.st_mtim.tv_nsec == task->cache.mtime_nsec)) {
+            task->loadcreatestatus = 6;
+            return;
+        }
+    }
+
+
+    {
+        double t0 = loadcreate_time();
+
+        task->fitsOK = (loadcreate_fits_open(task->fname, &task->fm) == 0) ? 1 : 0;
+        task->thdr += loadcreate_time() - t0;
+    }
+    if(task->fitsOK == 1) {
+        int sizeOK = (task->fm.naxis == task->naxis) ? 1 : 0;
+
+        if(task->createfromFITS == 1) { // create shared mem from FITS
+            if(sizeOK == 1) {
+                double t0 = loadcreate_time();
+
+                loadcreate_createstream(task, task->fm.naxes);
+                task->tcopy += loadcreate_time() - t0;
+                task->load = 1;
+                task->loadcreatestatus = 1;
+            }
+        } else {
+            for(i=0; i<task->naxis; i++)
+                if(task->fm.naxes[i] != task->size[i])
+                    sizeOK = 0;
+            if(sizeOK == 1) {
+                task->load = 1;
+                task->loadcreatestatus = 2;
+
+                // file touched or copied, but content unchanged ?
+                if((task->cacheOK == 1) && (task->cache.hash != 0) && (task->fm.fsize == task->cache.fsize)) {
+                    double t0 = loadcreate_time();
+
+                    task->hash = loadcreate_fits_hash(&task->fm, 1);
+                    task->thash += loadcreate_time() - t0;
+                    if(task->hash == task->cache.hash) {
+                        task->load = 0;
+                        task->cachewrite = 1;
+                        task->loadcreatestatus = 6;
+                    }
+                }
+            }
+        }
+
+        if(sizeOK == 0) {
+            printf("File \"%s\" has wrong size (should be %d-D %ld x %ld x %ld,  is %d-D %ld x %ld x %ld): ignoring\n", task->fname,
+                   task->naxis, task->size[0], task->size[1], (task->naxis == 3) ? task->size[2] : 1,
+                   task->fm.naxis, task->fm.naxes[0], task->fm.naxes[1], task->fm.naxes[2]);
+            task->loadcreatestatus = 3;
+        }
+    } else {
+        if(task->CreateSMim == 0) {
+            task->loadcreatestatus = 4;
+        } else {
+            task->loadcreatestatus = 5;
+        }
+    }
+
+    // stream to be created from FITS file, but FITS file not usable : remove wrong size stream
+    if(task->resize == 1) {
+        shmim_delete(task->name, task->ID);
+        task->ID = -1;
+        task->resize = 0;
+    }
+
+    // 3D load pending : flag stream as being loaded, no slice available yet (see loadcreate_load())
+    // 3D stream created, but no load : clear flag set at creation, stream holds DefaultValue
+    if((task->naxis == 3) && (task->ID != -1)) {
+        if(task->load == 1) {
+            data.image[task->ID].md[0].cnt1 = LOADSHM_NOSLICE;
+            data.image[task->ID].md[0].write = 1;
+        }
+        else if(task->CreateSMim == 1) {
+            data.image[task->ID].md[0].cnt1 = data.image[task->ID].md[0].size[2]-1;
+            data.image[task->ID].md[0].write = 0;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Load FITS data into stream
+ *
+ * Data is converted from the mapped file directly into the stream array (stream datatype), in chunks
+ * of LOADSHM_CHUNKSIZE elements, distributed over threads if parallel = 1.
+ *
+ * 3D streams are loaded in slice order, by groups of slices of about LOADSHM_STREAMBLOCK elements.
+ * While loading, md[0].write = 1 and md[0].cnt1 is the index of the last slice loaded (LOADSHM_NOSLICE
+ * before the first group), following the 3D stream convention of cnt1 = last slice written; semaphores
+ * are posted after each group, so that consumers can use the first slices before the load completes
+ * (see AOloopControl_IOtools_3Dshmim_waitslices()). The file region of the next group is prefetched
+ * while the current group is converted.
+ *
+ * Pages of each group are faulted in before conversion, so that I/O and conversion times can be
+ * reported separately. For files read with load_fits(), I/O time is part of header time.
+ */
+static void loadcreate_load(
+    LOADSHM_TASK *task,
+    int           parallel
+)
+{
+    long nelem = task->fm.nelem;
+    long slicenelem = nelem;
+    long NBslice = 1;
+    long groupslice = 1;
+    long slice;
+    long chunk1 = 0;
+    void *array;
+    uint64_t *chunkhash = NULL;
+
+    if(task->load == 0)
+        return;
+
+    // chunk hashes collected while converting (mapped files only), see loadcreate_fits_hash
+    if((task->hash == 0) && (task->fm.map != NULL))
+        chunkhash = (uint64_t*) malloc(sizeof(uint64_t)*(loadcreate_fits_NBchunk(&task->fm)+2));
+
+    array = data.image[task->ID].array.raw;
+    if(task->naxis == 3) {
+        NBslice = task->fm.naxes[2];
+        slicenelem = task->fm.naxes[0]*task->fm.naxes[1];
+        groupslice = LOADSHM_STREAMBLOCK/slicenelem;
+        if(groupslice < 1)
+            groupslice = 1;
+        data.image[task->ID].md[0].cnt1 = LOADSHM_NOSLICE;
+    }
+    else
+        groupslice = NBslice;
+    data.image[task->ID].md[0].write = 1;
+
+    for(slice=0; slice<NBslice; slice+=groupslice)
+    {
+        long nslice = NBslice-slice;
+        long offset;
+        long groupnelem;
+        long chunk0;
+        long chunk;
+
+        double t0;
+
+        if(nslice > groupslice)
+            nslice = groupslice;
+
+        // whole conversion chunks: group ends at first chunk boundary past its last slice
+        chunk0 = chunk1;
+        chunk1 = ((slice+nslice)*slicenelem + LOADSHM_CHUNKSIZE - 1)/LOADSHM_CHUNKSIZE;
+        offset = chunk0*LOADSHM_CHUNKSIZE;
+        groupnelem = chunk1*LOADSHM_CHUNKSIZE;
+        if(groupnelem > nelem)
+            groupnelem = nelem;
+        groupnelem -= offset;
+
+        // prefetch file region of next group
+        if((task->fm.map != NULL) && (slice+nslice < NBslice)) {
+            long pagesize = sysconf(_SC_PAGESIZE);
+            uintptr_t p0 = (uintptr_t) (task->fm.data + (offset+groupnelem)*task->fm.bytepix);
+            size_t len = groupnelem*task->fm.bytepix;
+
+            if(len > (size_t) (task->fm.map + task->fm.maplen - (unsigned char*) p0))
+                len = task->fm.map + task->fm.maplen - (unsigned char*) p0;
+            len += p0 % pagesize;
+            p0 -= p0 % pagesize;
+            madvise((void*) p0, len, MADV_WILLNEED);
+        }
+
+        // page in current group
+        t0 = loadcreate_time();
+        if(task->fm.map != NULL) {
+            const volatile unsigned char *p = task->fm.data + offset*task->fm.bytepix;
+            long len = groupnelem*task->fm.bytepix;
+            long pagesize = sysconf(_SC_PAGESIZE);
+            long k;
+            unsigned long sum = 0;
+
+# ifdef _OPENMP
+            #pragma omp parallel for reduction(+:sum) if ((parallel == 1)&&(groupnelem>OMP_NELEMENT_LIMIT))
+# endif
+            for(k=0; k<len; k+=pagesize)
+                sum += p[k];
+            (void) sum;
+        }
+        task->tio += loadcreate_time() - t0;
+
+        t0 = loadcreate_time();
+# ifdef _OPENMP
+        #pragma omp parallel for if ((parallel == 1)&&(groupnelem>OMP_NELEMENT_LIMIT))
+# endif
+        for(chunk=chunk0; chunk<chunk1; chunk++)
+        {
+            long n = nelem-chunk*LOADSHM_CHUNKSIZE;
+
+            if(n > LOADSHM_CHUNKSIZE)
+                n = LOADSHM_CHUNKSIZE;
+            loadcreate_fits_read(&task->fm, chunk*LOADSHM_CHUNKSIZE, n, task->datatype, array);
+            if(chunkhash != NULL) // hash raw chunk while still in cache
+                chunkhash[chunk+1] = loadcreate_fits_chunkhash(&task->fm, chunk);
+        }
+        task->tconv += loadcreate_time() - t0;
+
+        if(task->naxis == 3) { // publish progress
+            __sync_synchronize();
+            data.image[task->ID].md[0].cnt1 = slice+nslice-1;
+            COREMOD_MEMORY_image_set_sempost_byID(task->ID, -1);
+        }
+    }
+
+    if(task->naxis == 3)
+        data.image[task->ID].md[0].cnt1 = NBslice-1;
+    data.image[task->ID].md[0].cnt0++;
+    data.image[task->ID].md[0].write = 0;
+    if(task->naxis == 3)
+        COREMOD_MEMORY_image_set_sempost_byID(task->ID, -1);
+
+    task->nbyte = nelem*task->fm.bytepix;
+
+    if(chunkhash != NULL) {
+        double t0 = loadcreate_time();
+
+        task->hash = loadcreate_fits_hash_combine(&task->fm, chunkhash);
+        task->thash += loadcreate_time() - t0;
+        free(chunkhash);
+    }
+    task->cachewrite = 1;
+
+    if(loadcreate_verbose > 1)
+        printf("loaded file \"%s\" to shared memory \"%s\"\n", task->fname, task->name);
+}
+
+
+
+
+/** @brief FITS data throughput of task [MB/s], 0 if nothing loaded */
+static double loadcreate_throughput(
+    const LOADSHM_TASK *task
+)
+{
+    if((task->nbyte == 0) || (task->tio + task->tconv <= 0.0))
+        return 0.0;
+    return 1.0e-6*task->nbyte/(task->tio + task->tconv);
+}
+
+
+
+
+/** @brief Write load report of task, single line of key=value fields */
+static void loadcreate_report_line(
+    FILE               *fp,
+    const LOADSHM_TASK *task
+)
+{
+    fprintf(fp, "LOADREPORT stream=%s file=%s status=%d hdr=%.6f io=%.6f conv=%.6f copy=%.6f hash=%.6f total=%.6f bytes=%ld MBps=%.1f\n",
+            task->name, task->fname, task->loadcreatestatus, task->thdr, task->tio, task->tconv, task->tcopy, task->thash,
+            task->tprepare + task->tload, task->nbyte, loadcreate_throughput(task));
+}
+
+
+
+
+/** @brief Write load report table of NBtask tasks */
+static void loadcreate_report_table(
+    FILE               *fp,
+    const LOADSHM_TASK *task,
+    long                NBtask
+)
+{
+    long i;
+
+    fprintf(fp, "\n");
+    fprintf(fp, "  %-24s  %-40s  status   hdr[s]    io[s]  conv[s]  copy[s]  hash[s]  total[s]      MB     MB/s\n", "stream", "file");
+    for(i=0; i<NBtask; i++)
+        fprintf(fp, "  %-24s  %-40s  %6d  %7.4f  %7.4f  %7.4f  %7.4f  %7.4f  %8.4f  %6.1f  %7.1f\n",
+                task[i].name, task[i].fname, task[i].loadcreatestatus, task[i].thdr, task[i].tio, task[i].tconv, task[i].tcopy, task[i].thash,
+                task[i].tprepare + task[i].tload, 1.0e-6*task[i].nbyte, loadcreate_throughput(&task[i]));
+}
+
+
+
+
+/** @brief Close FITS file and log result */
+static void loadcreate_finish(
+    LOADSHM_TASK *task
+)
+{
+    if(task->cachewrite == 1) {
+        strcpy(task->cache.fname, task->fname);
+        task->cache.fsize = task->fm.fsize;
+        task->cache.mtime_sec = task->fm.mtime.tv_sec;
+        task->cache.mtime_nsec = task->fm.mtime.tv_nsec;
+        task->cache.hash = task->hash;
+        task->cache.cnt0 = data.image[task->ID].md[0].cnt0;
+        task->cache.generation = data.image[task->ID].md[0].cnt2;
+        task->cache.ctime_sec = data.image[task->ID].md[0].creationtime.tv_sec;
+        task->cache.ctime_nsec = data.image[task->ID].md[0].creationtime.tv_nsec;
+        loadcreate_cache_write(task->name, &task->cache);
+    }
+    else if(task->loadcreatestatus == 5)
+        loadcreate_cache_delete(task->name);
+
+    if(task->fitsOK == 1)
+        loadcreate_fits_close(&task->fm);
+
+    if(loadcreate_verbose > 1) {
+        printf("%5d   %s   %s <-> %s  exit status = %d\n", __LINE__, __FUNCTION__, task->name, task->fname, task->loadcreatestatus);
+        fflush(stdout);
+    }
+
+    if(loadcreateshm_log == 1) { // results should be logged in ASCII file
+        const char *fname = task->fname;
+        const char *name = task->name;
+
+        switch(task->loadcreatestatus) {
+            case 0 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream has wrong size -> recreating stream\n", fname, name);
+                break;
+            case 1 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: new stream created and content loaded\n", fname, name);
+                break;
+            case 2 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: existing stream updated\n", fname, name);
+                break;
+            case 3 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image has wrong size -> do nothing\n", fname, name);
+                break;
+            case 4 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream exists -> do nothing\n", fname, name);
+                break;
+            case 5 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image does not exist, stream does not exist -> create empty stream\n", fname, name);
+                break;
+            case 6 :
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: FITS image unchanged since last load -> do nothing\n", fname, name);
+                break;
+            default:
+                fprintf(loadcreateshm_fplog, "LOADING FITS FILE %s TO STREAM %s: UNKNOWN ERROR CODE\n", fname, name);
+                break;
+        }
+        loadcreate_report_line(loadcreateshm_fplog, task);
+    }
+}
+
+
+
+
+/** @brief Initialize load/create task */
+static void loadcreate_task_init(
+    LOADSHM_TASK *task,
+    const char   *name,
+    const char   *fname,
+    int           naxis,
+    long          xsize,
+    long          ysize,
+    long          zsize,
+    float         DefaultValue,
+    uint8_t       datatype
+)
+{
+    strncpy(task->name, name, 199);
+    task->name[199] = '\0';
+    strncpy(task->fname, fname, 499);
+    task->fname[499] = '\0';
+    task->naxis = naxis;
+    task->size[0] = xsize;
+    task->size[1] = ysize;
+    task->size[2] = (naxis == 3) ? zsize : 1;
+    task->DefaultValue = DefaultValue;
+    task->datatype = datatype;
+    if((shmim_typesize(datatype) == 0) || (datatype == _DATATYPE_COMPLEX_FLOAT) || (datatype == _DATATYPE_COMPLEX_DOUBLE))
+        task->datatype = _DATATYPE_FLOAT;
+    task->ID = -1;
+    task->fitsOK = 0;
+    task->tprepare = 0.0;
+    task->tload = 0.0;
+    task->thdr = 0.0;
+    task->tio = 0.0;
+    task->tconv = 0.0;
+    task->tcopy = 0.0;
+    task->thash = 0.0;
+    task->nbyte = 0;
+}
+
+
+
+
+/** @brief Run load/create task : prepare, load, finish, then report (single stream) */
+static long loadcreate_run(
+    LOADSHM_TASK *task
+)
+{
+    double t0;
+
+    t0 = loadcreate_time();
+    loadcreate_prepare(task);
+    task->tprepare = loadcreate_time() - t0;
+
+    t0 = loadcreate_time();
+    loadcreate_load(task, 1);
+    task->tload = loadcreate_time() - t0;
+
+    loadcreate_finish(task);
+
+    if(loadcreate_verbose > 0) {
+        loadcreate_report_line(stdout, task);
+        fflush(stdout);
+    }
+
+    return task->ID;
+}
+
+
+
+
+/**
+ * 
+ * Implements stream loading policy with optional check on size for 2D images.
+ * See CLIcore.h and loadcreate_prepare() for policy details.
+ * 
+ * The FITS file is memory-mapped, and its data converted directly into the stream,
+ * without intermediate image.
+ * 
+ */ 
+
+long AOloopControl_IOtools_2Dloadcreate_shmim(
+    const char *name,     // stream name
+    const char *fname,    // file name
+    long xsize,           // X size
+    long ysize,           // Y size
+    float DefaultValue
+) {
+    return AOloopControl_IOtools_2Dloadcreate_shmim_datatype(name, fname, xsize, ysize, DefaultValue, _DATATYPE_FLOAT);
+}
+
+
+
+
+/**
+ * 
+ * Same as AOloopControl_IOtools_2Dloadcreate_shmim(), with stream datatype.
+ * 
+ * FITS data is converted to datatype on load (integer types are rounded and clamped).
+ * An existing stream with a different datatype is replaced.
+ * 
+ */ 
+
+long AOloopControl_IOtools_2Dloadcreate_shmim_datatype(
+    const char *name,     // stream name
+    const char *fname,    // file name
+    long xsize,           // X size
+    long ysize,           // Y size
+    float DefaultValue,
+    uint8_t datatype      // stream datatype
+) {
+    LOADSHM_TASK task;
+
+#ifdef AOLOOPCONTROL_LOGFUNC
+    AOLOOPCONTROL_logfunc_level = 2;
+    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 0, __FILE__, __FUNCTION__, __LINE__, "");
+#endif
+
+    loadcreate_task_init(&task, name, fname, 2, xsize, ysize, 1, DefaultValue, datatype);
+    loadcreate_run(&task);
+
+#ifdef AOLOOPCONTROL_LOGFUNC
+    AOLOOPCONTROL_logfunc_level = 2;
+    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 1, __FILE__, __FUNCTION__, __LINE__, "");
+#endif
+
+    return task.ID;
+}
+
+
+
+
+
+
+
+
+/**
+ * 
+ * Implements stream loading policy with optional check on size for 3D images.
+ * See CLIcore.h and loadcreate_prepare() for policy details.
+ * If xsize = ysize = zsize = 0, the stream is created with the FITS file size.
+ * 
+ */ 
+
+long AOloopControl_IOtools_3Dloadcreate_shmim(
+    const char *name,
+    const char *fname,
+    long xsize,
+    long ysize,
+    long zsize,
+    float DefaultValue
+) {
+    return AOloopControl_IOtools_3Dloadcreate_shmim_datatype(name, fname, xsize, ysize, zsize, DefaultValue, _DATATYPE_FLOAT);
+}
+
+
+
+
+/**
+ * 
+ * Same as AOloopControl_IOtools_3Dloadcreate_shmim(), with stream datatype.
+ * 
+ * HALF precision suits large modal matrices, DOUBLE keeps full precision of calibrations.
+ * 
+ */ 
+
+long AOloopControl_IOtools_3Dloadcreate_shmim_datatype(
+    const char *name,
+    const char *fname,
+    long xsize,
+    long ysize,
+    long zsize,
+    float DefaultValue,
+    uint8_t datatype
+) {
+    LOADSHM_TASK task;
+
+#ifdef AOLOOPCONTROL_LOGFUNC
+    AOLOOPCONTROL_logfunc_level = 2;
+    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 0, __FILE__, __FUNCTION__, __LINE__, "");
+#endif
+
+    loadcreate_task_init(&task, name, fname, 3, xsize, ysize, zsize, DefaultValue, datatype);
+    loadcreate_run(&task);
+
+#ifdef AOLOOPCONTROL_LOGFUNC
+    AOLOOPCONTROL_logfunc_level = 2;
+    CORE_logFunctionCall(AOLOOPCONTROL_logfunc_level, AOLOOPCONTROL_logfunc_level_max, 1, __FILE__, __FUNCTION__, __LINE__, "");
+#endif
+
+    return task.ID;
+}
+
+
+
+
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Wait until the first NBslice slices of a 3D stream are loaded
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * name		CHAR*
+ * 			Stream name
+ * 
+ * @param[in]
+ * NBslice	LONG
+ * 			Number of slices needed
+ * 
+ * @param[in]
+ * timeout	DOUBLE
+ * 			Maximum wait time [s], <0 to wait indefinitely
+ * 
+ * 
+ * ## Details
+ * 
+ * For streams filled by the loadcreate and snapshot load functions : while the load is in progress
+ * (md[0].write = 1), md[0].cnt1 is the index of the last slice loaded (LOADSHM_NOSLICE if none), so
+ * cnt1+1 slices can be used before the load completes.\n
+ * Returns the number of slices available (all slices if no load is in progress), -1 if the stream
+ * does not exist.
+ * 
+ */
+
+long AOloopControl_IOtools_3Dshmim_waitslices(
+    const char *name,
+    long        NBslice,
+    double      timeout
+)
+{
+    long ID;
+    long NBsliceOK;
+    double tstart = loadcreate_time();
+    struct timespec tsleep = {0, 1000000};
+
+    ID = image_ID(name);
+    if(ID == -1)
+        ID = read_sharedmem_image(name);
+    if(ID == -1)
+        return -1;
+
+    for(;;)
+    {
+        NBsliceOK = data.image[ID].md[0].size[2];
+        if(data.image[ID].md[0].naxis < 3)
+            NBsliceOK = 1;
+        if(data.image[ID].md[0].write == 1) {
+            long NBloaded = (long) (data.image[ID].md[0].cnt1 + 1);   // 0 if LOADSHM_NOSLICE
+
+            if(NBloaded < NBsliceOK)
+                NBsliceOK = NBloaded;
+        }
+
+        if(NBsliceOK >= NBslice)
+            break;
+        if((timeout >= 0.0) && (loadcreate_time() - tstart > timeout))
+            break;
+        nanosleep(&tsleep, NULL);
+    }
+    __sync_synchronize();
+
+    return NBsliceOK;
+}
+
+
+
+
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Set verbosity of stream loaders (load/create functions and batch loader)
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * level	INT
+ * 			0 : no output (load report only written to log file, if enabled)\n
+ * 			1 : load report, one line per stream or one table per batch [default]\n
+ * 			2 : load report and step-by-step tracing, including image table listing
+ * 
+ * 
+ * ## Details
+ * 
+ * Returns previous level.
+ * 
+ */
+
+int AOloopControl_IOtools_loadcreate_setverbose(
+    int level
+)
+{
+    int prevlevel = loadcreate_verbose;
+
+    loadcreate_verbose = level;
+
+    return prevlevel;
+}
+
+
+
+
+
+
+
+
+/** @brief Shared state of batch load worker threads */
+typedef struct
+{
+    LOADSHM_TASK *task;
+    long          NBtask;
+    long          next;       // next task to load, incremented atomically
+} LOADSHM_BATCH;
+
+
+/** @brief Batch load worker thread: load tasks until none left */
+static void *loadcreate_batch_worker(
+    void *ptr
+)
+{
+    LOADSHM_BATCH *batch = (LOADSHM_BATCH*) ptr;
+
+    for(;;)
+    {
+        long i = __sync_fetch_and_add(&batch->next, 1);
+        double t0;
+
+        if(i >= batch->NBtask)
+            break;
+
+        t0 = loadcreate_time();
+        loadcreate_load(&batch->task[i], 0);
+        batch->task[i].tload = loadcreate_time() - t0;
+    }
+
+    return NULL;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Load/create a set of 2D and 3D streams listed in a manifest file, concurrently
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * manifest_fname	CHAR*
+ * 			Manifest file name. One entry per line :\n
+ * 			2D <stream> <FITS file> <xsize> <ysize> <default value>\n
+ * 			3D <stream> <FITS file> <xsize> <ysize> <zsize> <default value>\n
+ * 			Empty lines and lines starting with # are ignored.
+ * 
+ * @param[in]
+ * NBthread	INT
+ * 			Number of load threads
+ * 
+ * 
+ * ## Details
+ * 
+ * Same policy and loadcreatestatus codes as AOloopControl_IOtools_2Dloadcreate_shmim()
+ * and AOloopControl_IOtools_3Dloadcreate_shmim().\n
+ * Streams are resolved or created, and FITS headers opened, sequentially (image table
+ * operations are not thread-safe). FITS data of all entries are then loaded by a pool of
+ * NBthread threads, each loading one entry at a time. Files are closed and results logged
+ * sequentially.\n
+ * A table with status and timings of each entry is printed at the end.\n
+ * Returns the number of entries, -1 if the manifest cannot be read.
+ * 
+ */
+
+long AOloopControl_IOtools_loadcreate_shmim_batch(
+    const char *manifest_fname,
+    int         NBthread
+)
+{
+    FILE *fp;
+    char line[1000];
+    LOADSHM_BATCH batch;
+    long NBtaskmax = 0;
+    long i;
+    double t0, tstart;
+    pthread_t *threads;
+    int t;
+
+
+    fp = fopen(manifest_fname, "r");
+    if(fp == NULL)
+    {
+        printf("ERROR: cannot open manifest file \"%s\"\n", manifest_fname);
+        return -1;
+    }
+
+    // read manifest
+    batch.task = NULL;
+    batch.NBtask = 0;
+    batch.next = 0;
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        char type[10];
+        char name[200];
+        char fname[500];
+        long size[3];
+        float DefaultValue;
+        char typestr[16];
+        int NBread;
+
+        line[strcspn(line, "\n")] = '\0';
+        if((line[0] == '#')||(sscanf(line, "%9s", type) != 1))
+            continue;
+
+        if(batch.NBtask == NBtaskmax)
+        {
+            NBtaskmax = 2*NBtaskmax + 16;
+            batch.task = (LOADSHM_TASK*) realloc(batch.task, sizeof(LOADSHM_TASK)*NBtaskmax);
+            if(batch.task == NULL)
+            {
+                printf("ERROR: cannot allocate batch tasks\n");
+                exit(0);
+            }
+        }
+
+        if(strcmp(type, "2D") == 0)
+        {
+            NBread = sscanf(line, "%9s %199s %499s %ld %ld %f %15s", type, name, fname, &size[0], &size[1], &DefaultValue, typestr);
+            if(NBread == 6)
+                strcpy(typestr, "FLOAT");
+            if((NBread == 6)||(NBread == 7))
+            {
+                loadcreate_task_init(&batch.task[batch.NBtask], name, fname, 2, size[0], size[1], 1, DefaultValue, AOloopControl_IOtools_datatype_code(typestr));
+                batch.NBtask++;
+                continue;
+            }
+        }
+        else if(strcmp(type, "3D") == 0)
+        {
+            NBread = sscanf(line, "%9s %199s %499s %ld %ld %ld %f %15s", type, name, fname, &size[0], &size[1], &size[2], &DefaultValue, typestr);
+            if(NBread == 7)
+                strcpy(typestr, "FLOAT");
+            if((NBread == 7)||(NBread == 8))
+            {
+                loadcreate_task_init(&batch.task[batch.NBtask], name, fname, 3, size[0], size[1], size[2], DefaultValue, AOloopControl_IOtools_datatype_code(typestr));
+                batch.NBtask++;
+                continue;
+            }
+        }
+        printf("WARNING: manifest \"%s\": cannot parse line \"%s\"\n", manifest_fname, line);
+    }
+    fclose(fp);
+
+    tstart = loadcreate_time();
+
+
+    // resolve / create streams, open FITS files
+    for(i=0; i<batch.NBtask; i++)
+    {
+        t0 = loadcreate_time();
+        loadcreate_prepare(&batch.task[i]);
+        batch.task[i].tprepare = loadcreate_time() - t0;
+    }
+
+
+    // load data
+    if(NBthread < 1)
+        NBthread = 1;
+    if(NBthread > batch.NBtask)
+        NBthread = batch.NBtask;
+    threads = (pthread_t*) malloc(sizeof(pthread_t)*(NBthread+1));
+    for(t=0; t<NBthread; t++)
+        if(pthread_create(&threads[t], NULL, loadcreate_batch_worker, &batch) != 0)
+        {
+            printERROR(__FILE__, __func__, __LINE__, "pthread_create() error");
+            exit(0);
+        }
+    for(t=0; t<NBthread; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+
+
+    // close files, log
+    for(i=0; i<batch.NBtask; i++)
+        loadcreate_finish(&batch.task[i]);
+
+
+    if(loadcreate_verbose > 0) {
+        loadcreate_report_table(stdout, batch.task, batch.NBtask);
+        printf("  %ld entries, %d thread(s), total %.4f s\n\n", batch.NBtask, NBthread, loadcreate_time() - tstart);
+        fflush(stdout);
+    }
+
+    free(batch.task);
+
+    return batch.NBtask;
+}
+
+
+
+
+
+
+
+
+/* =============================================================================================== */
+/** @name AOloopControl_IOtools - 2. LOAD DATA STREAMS : SNAPSHOTS (NATIVE BINARY FORMAT)
+ *  
+ * Snapshot file layout (all fields in host byte order) :
+ * 
+ *   [ header, LOADSHM_SNAP_ALIGN bytes ]
+ *   [ chunk checksums, NBchunk x uint64, padded to LOADSHM_SNAP_ALIGN ]
+ *   [ data, datasize bytes, padded to LOADSHM_SNAP_ALIGN ]
+ * 
+ * Data chunks are LOADSHM_SNAP_CHUNKSIZE bytes (last chunk may be shorter), so that every
+ * chunk starts on a LOADSHM_SNAP_ALIGN boundary and can be read with O_DIRECT.
+ *  */
+/* =============================================================================================== */
+/* =============================================================================================== */
+
+
+/** @brief Snapshot file header */
+typedef struct
+{
+    char      magic[8];         // LOADSHM_SNAP_MAGIC
+    uint32_t  byteorder;        // 0x01020304 written in host byte order
+    uint32_t  version;
+    uint64_t  hdrsize;          // offset of checksum table
+    uint64_t  dataoffset;       // offset of data block
+
+    char      name[80];         // name of saved stream
+    uint8_t   datatype;
+    uint8_t   naxis;
+    uint16_t  NBsem;
+    uint32_t  size[3];
+    uint64_t  nelement;
+    uint64_t  cnt0;             // stream counters at save time
+    uint64_t  cnt1;
+    int64_t   creationtime_sec;
+    int64_t   creationtime_nsec;
+    int64_t   savetime_sec;
+    int64_t   savetime_nsec;
+
+    uint64_t  datasize;         // bytes
+    uint64_t  chunksize;        // bytes
+    uint64_t  NBchunk;
+    uint64_t  tablesum;         // checksum of chunk checksum table
+    uint64_t  hdrsum;           // checksum of header, computed with hdrsum = 0
+} LOADSHM_SNAPHEADER;
+
+
+
+
+/** @brief Checksum of snapshot header (computed with hdrsum field set to 0) */
+static uint64_t snapshot_header_sum(
+    const LOADSHM_SNAPHEADER *hdr
+)
+{
+    LOADSHM_SNAPHEADER tmp;
+
+    memcpy(&tmp, hdr, sizeof(LOADSHM_SNAPHEADER));
+    tmp.hdrsum = 0;
+
+    return loadcreate_hash_bytes((const unsigned char*) &tmp, sizeof(LOADSHM_SNAPHEADER));
+}
+
+
+
+
+/** @brief Write n bytes at offset, retrying on partial writes. Returns 0 if OK */
+static int snapshot_pwrite(
+    int         fd,
+    const void *buf,
+    size_t      n,
+    off_t       offset
+)
+{
+    const char *p = (const char*) buf;
+
+    while(n > 0) {
+        ssize_t w = pwrite(fd, p, n, offset);
+
+        if(w < 0) {
+            if(errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += w;
+        n -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+
+
+
+/** @brief Read n bytes at offset, retrying on partial reads. Returns number of bytes read, -1 on error */
+static ssize_t snapshot_pread(
+    int     fd,
+    void   *buf,
+    size_t  n,
+    off_t   offset
+)
+{
+    char *p = (char*) buf;
+    size_t nread = 0;
+
+    while(nread < n) {
+        ssize_t r = pread(fd, p+nread, n-nread, offset+nread);
+
+        if(r < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(r == 0)
+            break;
+        nread += r;
+    }
+    return nread;
+}
+
+
+
+
+/**
+ * @brief Verify data chunks of snapshot file fname against chunk checksums
+ *
+ * Chunks are read back in parallel. Returns the number of chunks that cannot be read or do not match.
+ */
+static long snapshot_verify(
+    const char               *fname,
+    const LOADSHM_SNAPHEADER *hdr,
+    const uint64_t           *chunksum
+)
+{
+    long NBerr = 0;
+    long k;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if(fd == -1)
+        return hdr->NBchunk + 1;
+
+# ifdef _OPENMP
+    #pragma omp parallel reduction(+:NBerr)
+    {
+# endif
+    unsigned char *buf = (unsigned char*) malloc(hdr->chunksize);
+
+# ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+# endif
+    for(k=0; k<(long) hdr->NBchunk; k++)
+    {
+        size_t n = hdr->datasize - k*hdr->chunksize;
+
+        if(n > hdr->chunksize)
+            n = hdr->chunksize;
+        if((buf == NULL) || (snapshot_pread(fd, buf, n, hdr->dataoffset + k*hdr->chunksize) != (ssize_t) n)
+                || (loadcreate_hash_bytes(buf, n) != chunksum[k]))
+            NBerr++;
+    }
+
+    free(buf);
+# ifdef _OPENMP
+    }
+# endif
+
+    close(fd);
+
+    return NBerr;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Save stream to snapshot file (native binary format)
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Stream name
+ * 
+ * @param[in]
+ * fname	CHAR*
+ * 			Snapshot file name
+ * 
+ * 
+ * ## Details
+ * 
+ * Writes header (stream metadata), per-chunk checksums and raw stream data.\n
+ * Chunks are processed in parallel : each chunk is copied from the stream into a per-thread
+ * buffer, and both its checksum and the data written come from that copy. If the stream is
+ * written during the save (write flag set, or cnt0 changed), the save is repeated, up to
+ * LOADSHM_SNAP_MAXTRY times. Each attempt waits at most LOADSHM_SNAP_WRITEWAIT s for the write
+ * flag to clear, so that a stream left with write = 1 makes the save fail instead of hang.\n
+ * The file is written to a temporary name, read back and verified against the checksums, then
+ * renamed, so that an interrupted or failed save does not leave a corrupted snapshot.\n
+ * Snapshots are meant for fast startup on the same machine / architecture: FITS remains the
+ * interchange format.\n
+ * Returns stream ID, -1 if the stream cannot be saved.
+ * 
+ */
+
+long AOloopControl_IOtools_shmim_snapshot_save(
+    const char *IDname,
+    const char *fname
+)
+{
+    long ID;
+    LOADSHM_SNAPHEADER hdr;
+    size_t typesize;
+    uint64_t *chunksum;
+    size_t tablesize;
+    const unsigned char *src;
+    char fnametmp[500];
+    struct timespec tnow;
+    long k;
+    int fd;
+    int i;
+    int attempt;
+    int err = 0;
+
+    ID = image_ID(IDname);
+    if(ID == -1)
+        ID = read_sharedmem_image(IDname);
+    if(ID == -1) {
+        printf("ERROR: stream \"%s\" not found\n", IDname);
+        return -1;
+    }
+
+    typesize = shmim_typesize(data.image[ID].md[0].datatype);
+    if(typesize == 0) {
+        printf("ERROR: stream \"%s\": datatype %d not supported\n", IDname, (int) data.image[ID].md[0].datatype);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(LOADSHM_SNAPHEADER));
+    memcpy(hdr.magic, LOADSHM_SNAP_MAGIC, 8);
+    hdr.byteorder = 0x01020304;
+    hdr.version = LOADSHM_SNAP_VERSION;
+    strncpy(hdr.name, IDname, sizeof(hdr.name)-1);
+    hdr.datatype = data.image[ID].md[0].datatype;
+    hdr.naxis = data.image[ID].md[0].naxis;
+    hdr.NBsem = data.image[ID].md[0].sem;
+    for(i=0; i<hdr.naxis; i++)
+        hdr.size[i] = data.image[ID].md[0].size[i];
+    hdr.nelement = data.image[ID].md[0].nelement;
+    hdr.creationtime_sec = data.image[ID].md[0].creationtime.tv_sec;
+    hdr.creationtime_nsec = data.image[ID].md[0].creationtime.tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &tnow);
+    hdr.savetime_sec = tnow.tv_sec;
+    hdr.savetime_nsec = tnow.tv_nsec;
+
+    hdr.datasize = hdr.nelement*typesize;
+    hdr.chunksize = LOADSHM_SNAP_CHUNKSIZE;
+    hdr.NBchunk = (hdr.datasize + hdr.chunksize - 1)/hdr.chunksize;
+    tablesize = sizeof(uint64_t)*hdr.NBchunk;
+    hdr.hdrsize = LOADSHM_SNAP_ALIGN;
+    hdr.dataoffset = hdr.hdrsize + ((tablesize + LOADSHM_SNAP_ALIGN - 1)/LOADSHM_SNAP_ALIGN)*LOADSHM_SNAP_ALIGN;
+
+
+    src = (const unsigned char*) data.image[ID].array.raw;
+    chunksum = (uint64_t*) calloc(hdr.NBchunk+1, sizeof(uint64_t));
+    if(chunksum == NULL) {
+        printERROR(__FILE__, __func__, __LINE__, "calloc error");
+        exit(0);
+    }
+
+    if(snprintf(fnametmp, 500, "%s.tmp%d", fname, (int) getpid()) >= 500) {
+        printERROR(__FILE__, __func__, __LINE__, "file name too long");
+        free(chunksum);
+        return -1;
+    }
+    fd = open(fnametmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        printf("ERROR: cannot create file \"%s\": %s\n", fnametmp, strerror(errno));
+        free(chunksum);
+        return -1;
+    }
+
+
+    // data chunks : checksum and write from the same copy, repeat if stream written meanwhile
+    for(attempt=0; attempt<LOADSHM_SNAP_MAXTRY; attempt++)
+    {
+        uint64_t cnt0;
+        double twait = loadcreate_time();
+
+        // bounded wait : write flag may be left set (crashed writer, invalid stream)
+        while((data.image[ID].md[0].write == 1) && (loadcreate_time() - twait < LOADSHM_SNAP_WRITEWAIT))
+            usleep(100);
+        if(data.image[ID].md[0].write == 1)
+            continue;
+        cnt0 = data.image[ID].md[0].cnt0;
+        hdr.cnt0 = cnt0;
+        hdr.cnt1 = data.image[ID].md[0].cnt1;
+        err = 0;
+
+# ifdef _OPENMP
+        #pragma omp parallel reduction(+:err)
+        {
+# endif
+        unsigned char *buf = (unsigned char*) malloc(hdr.chunksize);
+
+# ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+# endif
+        for(k=0; k<(long) hdr.NBchunk; k++)
+        {
+            size_t n = hdr.datasize - k*hdr.chunksize;
+
+            if(n > hdr.chunksize)
+                n = hdr.chunksize;
+            if(buf == NULL) {
+                err++;
+                continue;
+            }
+            memcpy(buf, src + k*hdr.chunksize, n);
+            chunksum[k] = loadcreate_hash_bytes(buf, n);
+            err += snapshot_pwrite(fd, buf, n, hdr.dataoffset + k*hdr.chunksize);
+        }
+
+        free(buf);
+# ifdef _OPENMP
+        }
+# endif
+
+        if((err != 0) || ((data.image[ID].md[0].write == 0) && (data.image[ID].md[0].cnt0 == cnt0)))
+            break;
+    }
+    if(attempt == LOADSHM_SNAP_MAXTRY) {
+        printf("ERROR: stream \"%s\" written, or write flag set, during each of %d save attempts\n", IDname, LOADSHM_SNAP_MAXTRY);
+        err++;
+    }
+
+    hdr.tablesum = loadcreate_hash_bytes((const unsigned char*) chunksum, tablesize);
+    hdr.hdrsum = snapshot_header_sum(&hdr);
+    err += snapshot_pwrite(fd, &hdr, sizeof(LOADSHM_SNAPHEADER), 0);
+    err += snapshot_pwrite(fd, chunksum, tablesize, hdr.hdrsize);
+
+    // pad data block so that last chunk can be read with O_DIRECT
+    if(ftruncate(fd, hdr.dataoffset + hdr.NBchunk*hdr.chunksize) != 0)
+        err++;
+    if(fdatasync(fd) != 0)
+        err++;
+    close(fd);
+
+    if((err == 0) && (snapshot_verify(fnametmp, &hdr, chunksum) != 0)) {
+        printf("ERROR: snapshot file \"%s\" does not verify\n", fnametmp);
+        err++;
+    }
+    free(chunksum);
+
+    if((err == 0) && (rename(fnametmp, fname) != 0))
+        err++;
+    if(err != 0) {
+        printf("ERROR: writing snapshot file \"%s\" failed\n", fname);
+        unlink(fnametmp);
+        return -1;
+    }
+
+    return ID;
+}
+
+
+
+
+/**
+ * ## Purpose
+ * 
+ * Load snapshot file (native binary format) into stream
+ * 
+ * ## Arguments
+ * 
+ * @param[in]
+ * fname	CHAR*
+ * 			Snapshot file name
+ * 
+ * @param[in]
+ * IDname	CHAR*
+ * 			Stream name. If empty string, the stream name stored in the snapshot is used
+ * 
+ * 
+ * ## Details
+ * 
+ * The stream is created if it does not exist, or resized with AOloopControl_IOtools_shmim_resize()
+ * if its size or datatype differ from the snapshot.\n
+ * Data chunks are read in parallel with O_DIRECT (when supported by the filesystem), directly
+ * into the stream array when the destination is aligned, through an aligned per-thread buffer
+ * otherwise. Each chunk is verified against its checksum.\n
+ * The stream is posted once all chunks are loaded and verified.\n
+ * Returns stream ID, -1 if the snapshot cannot be loaded. If a chunk fails to read or verify, the
+ * stream content has already been partly overwritten : the stream is left with its write flag set
+ * (and is not posted), marking it invalid until it is written again.
+ * 
+ */
+
+long AOloopControl_IOtools_shmim_snapshot_load(
+    const char *fname,
+    const char *IDname
+)
+{
+    LOADSHM_SNAPHEADER hdr;
+    const char *name;
+    uint64_t *chunksum;
+    size_t tablesize;
+    unsigned char *dst;
+    long ID;
+    long k;
+    int fd;
+    int direct = 1;
+    int i;
+    int sizeOK;
+    long NBerr = 0;
+
+
+    fd = open(fname, O_RDONLY | O_DIRECT);
+    if(fd == -1) {  // O_DIRECT not supported by filesystem
+        direct = 0;
+        fd = open(fname, O_RDONLY);
+    }
+    if(fd == -1) {
+        printf("ERROR: cannot open file \"%s\": %s\n", fname, strerror(errno));
+        return -1;
+    }
+    if(direct == 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+
+    // header and checksum table (read through aligned buffer, as required by O_DIRECT)
+    {
+        void *buf;
+
+        if(posix_memalign(&buf, LOADSHM_SNAP_ALIGN, LOADSHM_SNAP_ALIGN) != 0) {
+            printERROR(__FILE__, __func__, __LINE__, "posix_memalign error");
+            exit(0);
+        }
+        if(snapshot_pread(fd, buf, LOADSHM_SNAP_ALIGN, 0) != LOADSHM_SNAP_ALIGN) {
+            printf("ERROR: file \"%s\": cannot read snapshot header\n", fname);
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        memcpy(&hdr, buf, sizeof(LOADSHM_SNAPHEADER));
+        hdr.name[sizeof(hdr.name)-1] = '\0';
+        free(buf);
+    }
+
+    if((memcmp(hdr.magic, LOADSHM_SNAP_MAGIC, 8) != 0) || (hdr.byteorder != 0x01020304) || (hdr.version != LOADSHM_SNAP_VERSION)
+            || (hdr.hdrsum != snapshot_header_sum(&hdr))) {
+        printf("ERROR: file \"%s\" is not a valid snapshot for this version / architecture\n", fname);
+        close(fd);
+        return -1;
+    }
+    if((hdr.naxis < 1) || (hdr.naxis > 3) || (hdr.chunksize == 0) || (hdr.chunksize % LOADSHM_SNAP_ALIGN != 0)
+            || (shmim_typesize(hdr.datatype) == 0) || (hdr.datasize != hdr.nelement*shmim_typesize(hdr.datatype))
+            || (hdr.NBchunk != (hdr.datasize + hdr.chunksize - 1)/hdr.chunksize)) {
+        printf("ERROR: file \"%s\": inconsistent snapshot header\n", fname);
+        close(fd);
+        return -1;
+    }
+
+    tablesize = sizeof(uint64_t)*hdr.NBchunk;
+    {
+        size_t tablesizepad = hdr.dataoffset - hdr.hdrsize;
+        void *buf;
+
+        if(posix_memalign(&buf, LOADSHM_SNAP_ALIGN, tablesizepad+LOADSHM_SNAP_ALIGN) != 0) {
+            printERROR(__FILE__, __func__, __LINE__, "posix_memalign error");
+            exit(0);
+        }
+        chunksum = (uint64_t*) buf;
+        if((tablesizepad < tablesize) || (snapshot_pread(fd, buf, tablesizepad, hdr.hdrsize) != (ssize_t) tablesizepad)
+                || (loadcreate_hash_bytes((const unsigned char*) chunksum, tablesize) != hdr.tablesum)) {
+            printf("ERROR: file \"%s\": corrupted snapshot checksum table\n", fname);
+            free(chunksum);
+            close(fd);
+            return -1;
+        }
+    }
+
+
+    // resolve / create / resize stream
+    name = IDname;
+    if(name[0] == '\0')
+        name = hdr.name;
+
+    ID = image_ID(name);
+    if(ID == -1)
+        ID = read_sharedmem_image(name);
+
+    sizeOK = 0;
+    if(ID != -1) {
+        sizeOK = 1;
+        if(data.image[ID].md[0].datatype != hdr.datatype)
+            sizeOK = 0;
+        if(data.image[ID].md[0].naxis != hdr.naxis)
+            sizeOK = 0;
+        for(i=0; i<hdr.naxis; i++)
+            if(data.image[ID].md[0].size[i] != hdr.size[i])
+                sizeOK = 0;
+    }
+    if(sizeOK == 0) {
+        ID = AOloopControl_IOtools_shmim_resize(name, hdr.naxis, hdr.size, hdr.datatype);
+        if((data.image[ID].md[0].sem == 0) && (hdr.NBsem > 0))
+            COREMOD_MEMORY_image_set_createsem(name, hdr.NBsem);
+    }
+    loadcreate_cache_delete(name);   // stream no longer reflects a FITS file
+
+
+    // read chunks (3D : chunks complete in any order, no slice available until all are verified)
+    if(hdr.naxis == 3)
+        data.image[ID].md[0].cnt1 = LOADSHM_NOSLICE;
+    data.image[ID].md[0].write = 1;
+    dst = (unsigned char*) data.image[ID].array.raw;
+
+# ifdef _OPENMP
+    #pragma omp parallel reduction(+:NBerr)
+    {
+# endif
+    void *buf = NULL;
+
+    if(posix_memalign(&buf, LOADSHM_SNAP_ALIGN, hdr.chunksize) != 0)
+        buf = NULL;
+
+# ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+# endif
+    for(k=0; k<(long) hdr.NBchunk; k++)
+    {
+        size_t n = hdr.datasize - k*hdr.chunksize;
+        size_t nread;
+        unsigned char *p = dst + k*hdr.chunksize;
+
+        if(n > hdr.chunksize)
+            n = hdr.chunksize;
+        nread = n;
+        if(direct == 1)
+            nread = ((n + LOADSHM_SNAP_ALIGN - 1)/LOADSHM_SNAP_ALIGN)*LOADSHM_SNAP_ALIGN;
+
+        if((direct == 1) && ((uintptr_t) p % LOADSHM_SNAP_ALIGN == 0) && (nread == n)) {
+            if(snapshot_pread(fd, p, n, hdr.dataoffset + k*hdr.chunksize) != (ssize_t) n)
+                NBerr++;
+        }
+        else if(buf != NULL) {
+            if(snapshot_pread(fd, buf, nread, hdr.dataoffset + k*hdr.chunksize) < (ssize_t) n)
+                NBerr++;
+            else
+                memcpy(p, buf, n);
+        }
+        else
+            NBerr++;
+
+        if(loadcreate_hash_bytes(p, n) != chunksum[k])
+            NBerr++;
+    }
+
+    free(buf);
+# ifdef _OPENMP
+    }
+# endif
+
+    free(chunksum);
+    close(fd);
+
+    if(NBerr > 0) {
+        printf("ERROR: file \"%s\": %ld chunk(s) failed to read or verify, stream %s partially overwritten and left invalid (write = 1)\n", fname, NBerr, name);
+        return -1;
+    }
+
+    if(hdr.naxis == 3)   // restore saved slice index
+        data.image[ID].md[0].cnt1 = (hdr.cnt1 < hdr.size[2]) ? hdr.cnt1 : hdr.size[2]-1;
+    data.image[ID].md[0].cnt0++;
+    data.image[ID].md[0].write = 0;
+    COREMOD_MEMORY_image_set_sempost_byID(ID, -1);
+
+    return ID;
+}